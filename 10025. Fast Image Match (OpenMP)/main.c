@@ -1,5 +1,13 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "match.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define NDEBUG
@@ -10,74 +18,228 @@
 #define log(...)
 #endif
 
-struct int3tuple {
-  int x, y, z;
+// FFT engine wins once the template area exceeds this many times the
+// log2 of the transform size (measured: the SIMD direct loop does roughly
+// this many pixel ops in the time the FFT spends per butterfly)
+#define FFT_COST_FACTOR 48
+
+#define CACHE_LINE 64
+
+// image storage reused across test cases, grown on demand
+struct image_buf {
+  uint8_t *data;
+  size_t cap;
+};
+
+enum engine {
+  ENGINE_AUTO,
+  ENGINE_DIRECT,
+  ENGINE_FFT,
+  ENGINE_PRUNE,
+  ENGINE_PYRAMID,
+  ENGINE_OPENCL
 };
 
-static inline int cmp3tuple(struct int3tuple a, struct int3tuple b) {
-  if (a.x < b.x)
-    return -1;
-  if (a.x > b.x)
-    return 1;
-  if (a.y < b.y)
-    return -1;
-  if (a.y > b.y)
-    return 1;
-  if (a.z < b.z)
-    return -1;
-  if (a.z > b.z)
-    return 1;
-  return 0;
+// engine from environment variable
+// MATCH_ENGINE=auto|direct|fft|prune|pyramid|opencl
+static enum engine get_engine(void) {
+  const char *s = getenv("MATCH_ENGINE");
+  if (s == NULL || strcmp(s, "auto") == 0)
+    return ENGINE_AUTO;
+  if (strcmp(s, "direct") == 0)
+    return ENGINE_DIRECT;
+  if (strcmp(s, "fft") == 0)
+    return ENGINE_FFT;
+  if (strcmp(s, "prune") == 0)
+    return ENGINE_PRUNE;
+  if (strcmp(s, "pyramid") == 0)
+    return ENGINE_PYRAMID;
+#ifdef USE_OPENCL
+  if (strcmp(s, "opencl") == 0)
+    return ENGINE_OPENCL;
+#else
+  if (strcmp(s, "opencl") == 0) {
+    fprintf(stderr, "built without OpenCL (make OPENCL=1), using auto\n");
+    return ENGINE_AUTO;
+  }
+#endif
+  fprintf(stderr, "unknown MATCH_ENGINE=%s, using auto\n", s);
+  return ENGINE_AUTO;
 }
 
-#pragma omp declare reduction(min3tuple                                        \
-                              : struct int3tuple                               \
-                              : omp_out = cmp3tuple(omp_out, omp_in) > 0 ?     \
-                                          omp_in : omp_out)                    \
-                    initializer(omp_priv = (struct int3tuple) {1e9, -1, -1})
+// direct costs BH BW per candidate, FFT costs ~log2(P Q) per pixel of A
+static enum engine select_engine(int AH, int AW, int BH, int BW) {
+  int logpq = 0;
+  while ((1 << logpq) < AH)
+    logpq++;
+  for (int q = 1; q < AW; q *= 2)
+    logpq++;
+  double direct = (double)(AH - BH + 1) * (AW - BW + 1) * BH * BW;
+  double fft = (double)AH * AW * logpq * FFT_COST_FACTOR;
+  return direct > fft ? ENGINE_FFT : ENGINE_DIRECT;
+}
 
-uint8_t A[512][512];
-uint8_t B[512][512];
-int AH, AW, BH, BW;
+// read an h x w image into buf with rows padded to whole cache lines
+static struct image read_image(struct image_buf *buf, int h, int w) {
+  int stride = (w + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  size_t size = (size_t)h * (size_t)stride;
+  if (size > buf->cap) {
+    free(buf->data);
+    void *p = NULL;
+    if (posix_memalign(&p, CACHE_LINE, size) != 0) {
+      perror("posix_memalign");
+      exit(EXIT_FAILURE);
+    }
+    buf->data = p;
+    buf->cap = size;
+  }
+  for (int i = 0; i < h; i++) {
+    for (int j = 0; j < w; j++) {
+      scanf("%hhu", &buf->data[(size_t)i * (size_t)stride + (size_t)j]);
+    }
+  }
+  return (struct image){h, w, stride, buf->data};
+}
 
-int main() {
-  while (scanf("%d%d%d%d", &AH, &AW, &BH, &BW) == 4) {
-    for (int i = 0; i < AH; i++) {
-      for (int j = 0; j < AW; j++) {
-        scanf("%hhu", &A[i][j]);
-      }
+// Report mode, enabled by either environment variable
+//   MATCH_TOPK=K        the K best positions (0: no limit)
+//   MATCH_THRESHOLD=T   every position with SSD <= T
+// prints per case the number of matches, then one "x y ssd" line per match
+// from best to worst, ties broken as in the single best search.
+struct report {
+  int enabled;
+  int k;
+  int64_t threshold;
+};
+
+static struct report get_report(void) {
+  struct report r = {0, 0, INT64_MAX};
+  const char *k = getenv("MATCH_TOPK");
+  const char *t = getenv("MATCH_THRESHOLD");
+  if (k != NULL) {
+    char *end;
+    long v = strtol(k, &end, 10);
+    if (end == k || *end != '\0' || v < 0 || v > INT_MAX) {
+      fprintf(stderr, "MATCH_TOPK=%s: not a count >= 0\n", k);
+      exit(EXIT_FAILURE);
+    }
+    r.enabled = 1;
+    r.k = (int)v;
+  }
+  if (t != NULL) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(t, &end, 10);
+    if (end == t || *end != '\0' || errno == ERANGE || v < 0) {
+      fprintf(stderr, "MATCH_THRESHOLD=%s: not an SSD >= 0\n", t);
+      exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < BH; i++) {
-      for (int j = 0; j < BW; j++) {
-        scanf("%hhu", &B[i][j]);
-      }
+    r.enabled = 1;
+    r.threshold = v;
+  }
+  return r;
+}
+
+// one (A, B) pair per case: AH AW BH BW, A, B
+static void run_single(enum engine engine, struct report report) {
+  struct image_buf bufA = {NULL, 0}, bufB = {NULL, 0};
+
+  int AH, AW, BH, BW;
+  while (scanf("%d%d%d%d", &AH, &AW, &BH, &BW) == 4) {
+    struct image imgA = read_image(&bufA, AH, AW);
+    struct image imgB = read_image(&bufB, BH, BW);
+
+    if (report.enabled) {
+      struct ssd3tuple *matches = NULL;
+      int n = match_topk(&imgA, &imgB, report.k, report.threshold, &matches);
+      printf("%d\n", n);
+      for (int i = 0; i < n; i++)
+        printf("%d %d %" PRId64 "\n", matches[i].y + 1, matches[i].z + 1,
+               matches[i].x);
+      free(matches);
+      continue;
     }
 
+    enum engine e =
+        engine == ENGINE_AUTO ? select_engine(AH, AW, BH, BW) : engine;
+    log("AH=%d AW=%d BH=%d BW=%d engine=%d", AH, AW, BH, BW, e);
+
     // {min_diff, best_x, best_y}
-    struct int3tuple best = {1e9, -1, -1};
-#pragma omp parallel for reduction(min3tuple : best)
-    for (int si = 0; si < AH - BH + 1; si++) {
-      for (int sj = 0; sj < AW - BW + 1; sj++) {
-        int diff = 0;
-        for (int i = 0; i < BH; i++) {
-          for (int j = 0; j < BW; j++) {
-            int a = A[si + i][sj + j];
-            int b = B[i][j];
-            diff += (a - b) * (a - b);
-          }
-        }
-
-        log("si=%d sj=%d diff=%d best_x=%d best_y=%d min_diff=%d", si, sj, diff,
-            best.y, best.z, best.x);
-
-        struct int3tuple cand = {diff, si, sj};
-        if (cmp3tuple(cand, best) < 0) {
-          best = cand;
-        }
-      }
+    struct ssd3tuple best;
+    switch (e) {
+    case ENGINE_FFT:
+      best = match_fft(&imgA, &imgB);
+      break;
+    case ENGINE_PRUNE:
+      best = match_prune(&imgA, &imgB);
+      break;
+    case ENGINE_PYRAMID:
+      best = match_pyramid(&imgA, &imgB);
+      break;
+#ifdef USE_OPENCL
+    case ENGINE_OPENCL:
+      best = match_opencl(&imgA, &imgB);
+      break;
+#endif
+    default:
+      best = match_direct(&imgA, &imgB);
+      break;
     }
     printf("%d %d\n", best.y + 1, best.z + 1);
   }
+
+  free(bufA.data);
+  free(bufB.data);
+}
+
+// N templates per source image: AH AW N, A, then N times BH BW, B.
+// Prints one line per template, the same as N single cases would.
+static void run_batch(void) {
+  struct image_buf bufA = {NULL, 0};
+  struct image_buf *bufBs = NULL;
+  struct image *imgBs = NULL;
+  struct ssd3tuple *best = NULL;
+  int cap = 0;
+
+  int AH, AW, N;
+  while (scanf("%d%d%d", &AH, &AW, &N) == 3) {
+    if (N > cap) {
+      bufBs = realloc(bufBs, sizeof(struct image_buf) * (size_t)N);
+      imgBs = realloc(imgBs, sizeof(struct image) * (size_t)N);
+      best = realloc(best, sizeof(struct ssd3tuple) * (size_t)N);
+      for (int t = cap; t < N; t++)
+        bufBs[t] = (struct image_buf){NULL, 0};
+      cap = N;
+    }
+
+    struct image imgA = read_image(&bufA, AH, AW);
+    for (int t = 0; t < N; t++) {
+      int BH, BW;
+      if (scanf("%d%d", &BH, &BW) != 2)
+        BH = BW = 0;
+      imgBs[t] = read_image(&bufBs[t], BH, BW);
+    }
+    log("AH=%d AW=%d N=%d", AH, AW, N);
+
+    match_batch(&imgA, imgBs, N, best);
+    for (int t = 0; t < N; t++)
+      printf("%d %d\n", best[t].y + 1, best[t].z + 1);
+  }
+
+  for (int t = 0; t < cap; t++)
+    free(bufBs[t].data);
+  free(bufBs);
+  free(imgBs);
+  free(best);
+  free(bufA.data);
+}
+
+int main() {
+  const char *batch = getenv("MATCH_BATCH");
+  if (batch != NULL && strcmp(batch, "1") == 0)
+    run_batch();
+  else
+    run_single(get_engine(), get_report());
 }
 
 // vim: sw=2
@@ -0,0 +1,113 @@
+// TILE_H, TILE_W, CHUNK and RED_WG are given as build options by match_cl.c.
+// A work-group scores a TILE_H x TILE_W tile of candidates, one candidate per
+// work-item; TILE_H * TILE_W and RED_WG must be powers of two for the
+// reductions.
+
+#define WG (TILE_H * TILE_W)
+#define LAH (TILE_H + CHUNK - 1) // rows of A under a tile and a chunk of B
+#define LAW (TILE_W + CHUNK - 1)
+
+// (ssd, si, sj) lexicographic order, same as cmp3tuple on the host
+static inline bool better(ulong sa, int2 pa, ulong sb, int2 pb) {
+  if (sa != sb)
+    return sa < sb;
+  if (pa.x != pb.x)
+    return pa.x < pb.x;
+  return pa.y < pb.y;
+}
+
+// best candidate of each work-group -> grpSsd/grpPos[group]
+__kernel void ssd_tile(__global const uchar *A, int AH, int AW, int lda,
+                       __global const uchar *B, int BH, int BW, int ldb,
+                       __global ulong *grpSsd, __global int2 *grpPos) {
+  // The template is walked in CHUNK x CHUNK pieces. For each piece the
+  // work-group stages the piece of B and the part of A under all its
+  // candidates in local memory, so every pixel is fetched from global memory
+  // once per work-group instead of once per candidate.
+  __local uchar la[LAH * LAW];
+  __local uchar lb[CHUNK * CHUNK];
+  __local ulong lssd[WG];
+  __local int2 lpos[WG];
+
+  int lx = get_local_id(0), ly = get_local_id(1);
+  int lid = ly * TILE_W + lx;
+  int sj = get_global_id(0), si = get_global_id(1);
+  int sj0 = get_group_id(0) * TILE_W, si0 = get_group_id(1) * TILE_H;
+  bool valid = si < AH - BH + 1 && sj < AW - BW + 1;
+
+  ulong ssd = 0;
+  for (int r0 = 0; r0 < BH; r0 += CHUNK) {
+    for (int c0 = 0; c0 < BW; c0 += CHUNK) {
+      int rh = min(CHUNK, BH - r0), cw = min(CHUNK, BW - c0);
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for (int k = lid; k < CHUNK * CHUNK; k += WG) {
+        int i = k / CHUNK, j = k % CHUNK;
+        lb[k] = i < rh && j < cw ? B[(r0 + i) * ldb + c0 + j] : 0;
+      }
+      for (int k = lid; k < LAH * LAW; k += WG) {
+        int y = si0 + r0 + k / LAW, x = sj0 + c0 + k % LAW;
+        la[k] = y < AH && x < AW ? A[y * lda + x] : 0;
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      // at most CHUNK^2 * 255^2, fits in 32 bits
+      uint part = 0;
+      for (int i = 0; i < rh; i++) {
+        for (int j = 0; j < cw; j++) {
+          int d = (int)la[(ly + i) * LAW + lx + j] - (int)lb[i * CHUNK + j];
+          part += (uint)(d * d);
+        }
+      }
+      ssd += part;
+    }
+  }
+
+  lssd[lid] = valid ? ssd : ULONG_MAX;
+  lpos[lid] = (int2)(si, sj);
+  for (int s = WG / 2; s > 0; s /= 2) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s && better(lssd[lid + s], lpos[lid + s], lssd[lid], lpos[lid])) {
+      lssd[lid] = lssd[lid + s];
+      lpos[lid] = lpos[lid + s];
+    }
+  }
+  if (lid == 0) {
+    int g = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+    grpSsd[g] = lssd[0];
+    grpPos[g] = lpos[0];
+  }
+}
+
+// one work-group of RED_WG items reduces the n group results -> res[0]
+__kernel void reduce_best(__global const ulong *grpSsd,
+                          __global const int2 *grpPos, int n,
+                          __global ulong *resSsd, __global int2 *resPos) {
+  __local ulong lssd[RED_WG];
+  __local int2 lpos[RED_WG];
+
+  int lid = get_local_id(0);
+  ulong best = ULONG_MAX;
+  int2 bpos = (int2)(-1, -1);
+  for (int g = lid; g < n; g += RED_WG) {
+    if (better(grpSsd[g], grpPos[g], best, bpos)) {
+      best = grpSsd[g];
+      bpos = grpPos[g];
+    }
+  }
+  lssd[lid] = best;
+  lpos[lid] = bpos;
+  for (int s = RED_WG / 2; s > 0; s /= 2) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s && better(lssd[lid + s], lpos[lid + s], lssd[lid], lpos[lid])) {
+      lssd[lid] = lssd[lid + s];
+      lpos[lid] = lpos[lid + s];
+    }
+  }
+  if (lid == 0) {
+    resSsd[0] = lssd[0];
+    resPos[0] = lpos[0];
+  }
+}
+
+// vim: syntax=c sw=2
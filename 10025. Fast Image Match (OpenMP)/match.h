@@ -0,0 +1,95 @@
+#ifndef _MATCH_H
+#define _MATCH_H
+
+#include <stdint.h>
+
+// grayscale image, row i starts at pixels + i * stride
+// (images read by main.c have a cache-line aligned stride and base)
+struct image {
+  int h, w;
+  int stride;
+  const uint8_t *pixels;
+};
+
+#define image_row(img, i) ((img)->pixels + (long)(i) * (img)->stride)
+
+// {ssd, y, x}: SSD of the window whose top-left corner is (y, x)
+struct ssd3tuple {
+  int64_t x;
+  int y, z;
+};
+
+static inline int cmp3tuple(struct ssd3tuple a, struct ssd3tuple b) {
+  if (a.x < b.x)
+    return -1;
+  if (a.x > b.x)
+    return 1;
+  if (a.y < b.y)
+    return -1;
+  if (a.y > b.y)
+    return 1;
+  if (a.z < b.z)
+    return -1;
+  if (a.z > b.z)
+    return 1;
+  return 0;
+}
+
+#pragma omp declare reduction(min3tuple                                        \
+                              : struct ssd3tuple                               \
+                              : omp_out = cmp3tuple(omp_out, omp_in) > 0 ?     \
+                                          omp_in : omp_out)                    \
+                    initializer(omp_priv = (struct ssd3tuple) {INT64_MAX, -1, -1})
+
+// The (si, sj) search space is cut into TILE_H x TILE_W tiles of candidates
+// handed out dynamically, so a short and wide (or tall and narrow) search
+// space still has enough work items to keep every thread busy. A tile row
+// is one contiguous run along A, which keeps the window reads streaming.
+#define TILE_H 8
+#define TILE_W 32
+
+// All engines return {min_diff, best_x, best_y} where (best_x, best_y) is the
+// 0-based top-left corner of B in A, ties broken by smallest x then y.
+
+// brute force: O((AH-BH+1)(AW-BW+1) BH BW)
+struct ssd3tuple match_direct(const struct image *A, const struct image *B);
+
+// SSD = sum(A^2) - 2 sum(AB) + sum(B^2), with sum(A^2) from a summed-area
+// table and sum(AB) from FFT cross-correlation: O(AH AW log(AH AW))
+struct ssd3tuple match_fft(const struct image *A, const struct image *B);
+
+// brute force with branch-and-bound: a candidate is abandoned as soon as its
+// partial SSD exceeds the best complete SSD any thread has found so far
+struct ssd3tuple match_prune(const struct image *A, const struct image *B);
+
+// same, starting from a known upper bound on the minimum SSD; the result is
+// still exact as long as some candidate really scores <= bound
+struct ssd3tuple match_prune_bound(const struct image *A,
+                                   const struct image *B, int64_t bound);
+
+// coarse-to-fine: exhaustive search on a 2x/4x/8x downsampled pyramid, then
+// only the neighbourhood of the best few candidates is refined at each finer
+// level. The refined answer seeds match_prune_bound, which certifies it.
+struct ssd3tuple match_pyramid(const struct image *A, const struct image *B);
+
+
+// OpenCL: one work-group per tile of candidates with the template and source
+// pieces staged in __local memory, reduced to the best candidate on the
+// device. Kernels are in match.cl, built with make OPENCL=1.
+struct ssd3tuple match_opencl(const struct image *A, const struct image *B);
+
+// N templates against one source: each tile of candidates is scored against
+// every template while its part of A is in cache. best[t] is what a single
+// search for Bs[t] would return.
+void match_batch(const struct image *A, const struct image *Bs, int n,
+                 struct ssd3tuple *best);
+
+// every position with SSD <= threshold, at most k of them (k <= 0: no limit),
+// sorted best first. *out is malloc'ed, returns the number of matches.
+// Each thread keeps a private bounded heap; the heaps are sorted and merged
+// pairwise in parallel, and cmp3tuple is a total order, so the output does
+// not depend on the number of threads.
+int match_topk(const struct image *A, const struct image *B, int k,
+               int64_t threshold, struct ssd3tuple **out);
+
+#endif
@@ -0,0 +1,71 @@
+#include "match.h"
+#include "ssd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+void match_batch(const struct image *A, const struct image *Bs, int n,
+                 struct ssd3tuple *best) {
+  // tiles cover the union of all search spaces, which is the search space of
+  // the smallest template in each direction
+  int RH = 0, RW = 0;
+  for (int t = 0; t < n; t++) {
+    if (A->h - Bs[t].h + 1 > RH)
+      RH = A->h - Bs[t].h + 1;
+    if (A->w - Bs[t].w + 1 > RW)
+      RW = A->w - Bs[t].w + 1;
+    best[t] = (struct ssd3tuple){INT64_MAX, -1, -1};
+  }
+  int ntw = (RW + TILE_W - 1) / TILE_W;
+  int ntile = (RH + TILE_H - 1) / TILE_H * ntw;
+  log("match_batch n=%d RH=%d RW=%d ntile=%d", n, RH, RW, ntile);
+
+#pragma omp parallel
+  {
+    // {min_diff, best_x, best_y} of each template, private to the thread
+    struct ssd3tuple *local = malloc(sizeof(struct ssd3tuple) * (size_t)n);
+    for (int t = 0; t < n; t++)
+      local[t] = (struct ssd3tuple){INT64_MAX, -1, -1};
+
+    // the A region under a tile is loaded once and then scored against every
+    // template while it is still in cache
+#pragma omp for schedule(dynamic) nowait
+    for (int k = 0; k < ntile; k++) {
+      int si0 = k / ntw * TILE_H, sj0 = k % ntw * TILE_W;
+      for (int t = 0; t < n; t++) {
+        const struct image *B = &Bs[t];
+        int rh = A->h - B->h + 1, rw = A->w - B->w + 1;
+        int si1 = si0 + TILE_H < rh ? si0 + TILE_H : rh;
+        int sj1 = sj0 + TILE_W < rw ? sj0 + TILE_W : rw;
+        for (int si = si0; si < si1; si++) {
+          for (int sj = sj0; sj < sj1; sj++) {
+            int64_t diff = ssd_window(image_row(A, si) + sj, A->stride,
+                                      B->pixels, B->stride, B->h, B->w);
+            struct ssd3tuple cand = {diff, si, sj};
+            if (cmp3tuple(cand, local[t]) < 0) {
+              local[t] = cand;
+            }
+          }
+        }
+      }
+    }
+
+#pragma omp critical
+    for (int t = 0; t < n; t++)
+      if (cmp3tuple(local[t], best[t]) < 0)
+        best[t] = local[t];
+
+    free(local);
+  }
+}
+
+// vim: sw=2
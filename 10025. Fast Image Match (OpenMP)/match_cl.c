@@ -0,0 +1,360 @@
+#define CL_TARGET_OPENCL_VERSION 200
+
+#include "match.h"
+
+#include <CL/cl.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG
+
+#define MAX_INFO_BUF 64
+#define MAX_PLATFORMS 8
+#define MAX_BUILD_OPTS 128
+
+#define KERNEL_FILE "match.cl"
+
+// template piece staged in local memory per step, see match.cl
+#define CHUNK 16
+// work-group size of the final reduction
+#define RED_WG 256
+
+#define FG_RED "\033[31m"
+#define FG_RESET "\033[0m"
+
+#define arrsize(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define logerr(fmt, ...)                                                       \
+  fprintf(stderr, FG_RED fmt "\n" FG_RESET, ##__VA_ARGS__)
+
+#ifndef NDEBUG
+#define logdbg(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define logdbg(...)
+#endif
+
+#define clCheckError(command)                                                  \
+  {                                                                            \
+    cl_int _ret = (command);                                                   \
+    if (_ret != CL_SUCCESS) {                                                  \
+      logerr("Error at " __FILE__ " (" STRINGIZE(__LINE__) "): %s",            \
+                                                 clErrorStr(_ret));            \
+      abort();                                                                 \
+    }                                                                          \
+  }
+
+#define _STRINGIZE(x) #x
+#define STRINGIZE(x) _STRINGIZE(x)
+
+static const char *clErrorStr(cl_int err) {
+  switch (err) {
+#define CaseReturnString(x)                                                    \
+  case x:                                                                      \
+    return #x;
+
+    CaseReturnString(CL_SUCCESS);
+    CaseReturnString(CL_DEVICE_NOT_FOUND);
+    CaseReturnString(CL_DEVICE_NOT_AVAILABLE);
+    CaseReturnString(CL_COMPILER_NOT_AVAILABLE);
+    CaseReturnString(CL_MEM_OBJECT_ALLOCATION_FAILURE);
+    CaseReturnString(CL_OUT_OF_RESOURCES);
+    CaseReturnString(CL_OUT_OF_HOST_MEMORY);
+    CaseReturnString(CL_BUILD_PROGRAM_FAILURE);
+    CaseReturnString(CL_INVALID_VALUE);
+    CaseReturnString(CL_INVALID_DEVICE_TYPE);
+    CaseReturnString(CL_INVALID_PLATFORM);
+    CaseReturnString(CL_INVALID_DEVICE);
+    CaseReturnString(CL_INVALID_CONTEXT);
+    CaseReturnString(CL_INVALID_COMMAND_QUEUE);
+    CaseReturnString(CL_INVALID_HOST_PTR);
+    CaseReturnString(CL_INVALID_MEM_OBJECT);
+    CaseReturnString(CL_INVALID_BINARY);
+    CaseReturnString(CL_INVALID_BUILD_OPTIONS);
+    CaseReturnString(CL_INVALID_PROGRAM);
+    CaseReturnString(CL_INVALID_PROGRAM_EXECUTABLE);
+    CaseReturnString(CL_INVALID_KERNEL_NAME);
+    CaseReturnString(CL_INVALID_KERNEL_DEFINITION);
+    CaseReturnString(CL_INVALID_KERNEL);
+    CaseReturnString(CL_INVALID_ARG_INDEX);
+    CaseReturnString(CL_INVALID_ARG_VALUE);
+    CaseReturnString(CL_INVALID_ARG_SIZE);
+    CaseReturnString(CL_INVALID_KERNEL_ARGS);
+    CaseReturnString(CL_INVALID_WORK_DIMENSION);
+    CaseReturnString(CL_INVALID_WORK_GROUP_SIZE);
+    CaseReturnString(CL_INVALID_WORK_ITEM_SIZE);
+    CaseReturnString(CL_INVALID_GLOBAL_OFFSET);
+    CaseReturnString(CL_INVALID_EVENT_WAIT_LIST);
+    CaseReturnString(CL_INVALID_EVENT);
+    CaseReturnString(CL_INVALID_OPERATION);
+    CaseReturnString(CL_INVALID_BUFFER_SIZE);
+    CaseReturnString(CL_INVALID_GLOBAL_WORK_SIZE);
+#undef CaseReturnString
+  default:
+    return "Unknown OpenCL error code";
+  }
+}
+
+// set up once, on the first call of match_opencl
+static struct {
+  bool ready;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel ssdTile, reduceBest;
+  size_t tileH, tileW, redWG;
+} cl;
+
+static void cl_release(void) {
+  clReleaseKernel(cl.reduceBest);
+  clReleaseKernel(cl.ssdTile);
+  clReleaseProgram(cl.program);
+  clReleaseCommandQueue(cl.queue);
+  clReleaseContext(cl.context);
+}
+
+// device type from environment variable MATCH_CL_DEVICE=cpu|gpu|all
+static cl_device_type get_device_type(void) {
+  const char *s = getenv("MATCH_CL_DEVICE");
+  if (s != NULL && strcmp(s, "cpu") == 0)
+    return CL_DEVICE_TYPE_CPU;
+  if (s != NULL && strcmp(s, "gpu") == 0)
+    return CL_DEVICE_TYPE_GPU;
+  return CL_DEVICE_TYPE_ALL;
+}
+
+static char *read_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    logerr("cannot open %s", path);
+    abort();
+  }
+  fseek(fp, 0, SEEK_END);
+  long n = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc((size_t)n + 1);
+  *size = fread(buf, 1, (size_t)n, fp);
+  buf[*size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// Halve the tile (the wider side first) and the reduction group until they
+// fit in the given work-group sizes; both stay powers of two, as match.cl
+// needs.
+static void shrink_groups(size_t tileLimit, size_t redLimit) {
+  if (tileLimit == 0 || redLimit == 0) {
+    logerr("OpenCL device cannot run the match kernels in any work-group");
+    abort();
+  }
+  while (cl.tileH * cl.tileW > tileLimit) {
+    if (cl.tileW >= cl.tileH)
+      cl.tileW /= 2;
+    else
+      cl.tileH /= 2;
+  }
+  while (cl.redWG > redLimit)
+    cl.redWG /= 2;
+}
+
+// (re)build the program for the current sizes and create both kernels
+static void cl_build(void) {
+  cl_int ret = 0;
+  char opts[MAX_BUILD_OPTS];
+  snprintf(opts, sizeof(opts),
+           "-DTILE_H=%zu -DTILE_W=%zu -DCHUNK=%d -DRED_WG=%zu", cl.tileH,
+           cl.tileW, CHUNK, cl.redWG);
+  ret = clBuildProgram(cl.program, 1, &cl.device, opts, NULL, NULL);
+  if (ret != CL_SUCCESS) {
+    // print log if building failed
+    size_t buildLogSize = 0;
+    clCheckError(clGetProgramBuildInfo(cl.program, cl.device,
+                                       CL_PROGRAM_BUILD_LOG, 0, NULL,
+                                       &buildLogSize));
+    char *buildLog = malloc(buildLogSize);
+    clCheckError(clGetProgramBuildInfo(cl.program, cl.device,
+                                       CL_PROGRAM_BUILD_LOG, buildLogSize,
+                                       buildLog, NULL));
+    fprintf(stderr, "%s", buildLog);
+    free(buildLog);
+    clCheckError(ret);
+  }
+
+  cl.ssdTile = clCreateKernel(cl.program, "ssd_tile", &ret);
+  clCheckError(ret);
+  cl.reduceBest = clCreateKernel(cl.program, "reduce_best", &ret);
+  clCheckError(ret);
+}
+
+static void cl_init(void) {
+  cl_int ret = 0;
+
+  // first device of the wanted type on any platform
+  cl_platform_id platforms[MAX_PLATFORMS];
+  cl_uint platformN = 0;
+  clCheckError(clGetPlatformIDs(arrsize(platforms), platforms, &platformN));
+  logdbg("Found %u platforms", platformN);
+
+  cl_device_type type = get_device_type();
+  cl_uint deviceN = 0;
+  for (cl_uint i = 0; i < platformN && deviceN == 0; i++) {
+    if (clGetDeviceIDs(platforms[i], type, 1, &cl.device, &deviceN) !=
+        CL_SUCCESS)
+      deviceN = 0;
+  }
+  if (deviceN == 0) {
+    logerr("No OpenCL device found");
+    abort();
+  }
+#ifndef NDEBUG
+  char name[MAX_INFO_BUF];
+  clCheckError(
+      clGetDeviceInfo(cl.device, CL_DEVICE_NAME, sizeof(name), name, NULL));
+  logdbg("Device Name: %s", name);
+#endif
+
+  cl.context = clCreateContext(NULL, 1, &cl.device, NULL, NULL, &ret);
+  clCheckError(ret);
+  cl.queue =
+      clCreateCommandQueueWithProperties(cl.context, cl.device, NULL, &ret);
+  clCheckError(ret);
+
+  // 8 x 32 candidates per work-group, fewer on devices with small groups
+  size_t maxWG = 0;
+  clCheckError(clGetDeviceInfo(cl.device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                               sizeof(maxWG), &maxWG, NULL));
+  cl.tileH = TILE_H;
+  cl.tileW = TILE_W;
+  cl.redWG = RED_WG;
+  shrink_groups(maxWG, maxWG);
+
+  size_t srcSize = 0;
+  char *src = read_file(KERNEL_FILE, &srcSize);
+  const char *srcs[1] = {src};
+  cl.program = clCreateProgramWithSource(cl.context, 1, srcs, &srcSize, &ret);
+  clCheckError(ret);
+  free(src);
+
+  // The sizes are compiled into the kernels, and a kernel may run in
+  // smaller groups than the device allows (local memory, registers), so
+  // build, ask, and build again smaller until both kernels fit.
+  for (;;) {
+    cl_build();
+    size_t tileLimit = 0, redLimit = 0;
+    clCheckError(clGetKernelWorkGroupInfo(cl.ssdTile, cl.device,
+                                          CL_KERNEL_WORK_GROUP_SIZE,
+                                          sizeof(tileLimit), &tileLimit,
+                                          NULL));
+    clCheckError(clGetKernelWorkGroupInfo(cl.reduceBest, cl.device,
+                                          CL_KERNEL_WORK_GROUP_SIZE,
+                                          sizeof(redLimit), &redLimit, NULL));
+    logdbg("tile %zux%zu (limit %zu), reduction %zu (limit %zu)", cl.tileH,
+           cl.tileW, tileLimit, cl.redWG, redLimit);
+    if (cl.tileH * cl.tileW <= tileLimit && cl.redWG <= redLimit)
+      break;
+    clReleaseKernel(cl.reduceBest);
+    clReleaseKernel(cl.ssdTile);
+    shrink_groups(tileLimit, redLimit);
+  }
+
+  cl.ready = true;
+  atexit(cl_release);
+}
+
+struct ssd3tuple match_opencl(const struct image *A, const struct image *B) {
+  int AH = A->h, AW = A->w, BH = B->h, BW = B->w;
+  int RH = AH - BH + 1, RW = AW - BW + 1;
+  // no position at all: the empty result of the CPU engines, before the
+  // sizes below turn negative counts into huge ones
+  if (RH <= 0 || RW <= 0)
+    return (struct ssd3tuple){INT64_MAX, -1, -1};
+
+  cl_int ret = 0;
+  if (!cl.ready)
+    cl_init();
+
+  size_t groupsW = ((size_t)RW + cl.tileW - 1) / cl.tileW;
+  size_t groupsH = ((size_t)RH + cl.tileH - 1) / cl.tileH;
+  cl_int groupN = (cl_int)(groupsW * groupsH);
+  logdbg("match_opencl RH=%d RW=%d groups=%zux%zu", RH, RW, groupsH, groupsW);
+
+  // buffer
+  cl_mem bufA = clCreateBuffer(
+      cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      (size_t)AH * (size_t)A->stride, (void *)A->pixels, &ret);
+  clCheckError(ret);
+  cl_mem bufB = clCreateBuffer(
+      cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      (size_t)BH * (size_t)B->stride, (void *)B->pixels, &ret);
+  clCheckError(ret);
+  cl_mem bufGrpSsd = clCreateBuffer(cl.context, CL_MEM_READ_WRITE,
+                                    sizeof(cl_ulong) * (size_t)groupN, NULL,
+                                    &ret);
+  clCheckError(ret);
+  cl_mem bufGrpPos = clCreateBuffer(cl.context, CL_MEM_READ_WRITE,
+                                    sizeof(cl_int2) * (size_t)groupN, NULL,
+                                    &ret);
+  clCheckError(ret);
+  cl_mem bufResSsd = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY,
+                                    sizeof(cl_ulong), NULL, &ret);
+  clCheckError(ret);
+  cl_mem bufResPos = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY,
+                                    sizeof(cl_int2), NULL, &ret);
+  clCheckError(ret);
+
+  // kernel arguments
+  cl_int lda = A->stride, ldb = B->stride;
+  clCheckError(clSetKernelArg(cl.ssdTile, 0, sizeof(bufA), &bufA));
+  clCheckError(clSetKernelArg(cl.ssdTile, 1, sizeof(AH), &AH));
+  clCheckError(clSetKernelArg(cl.ssdTile, 2, sizeof(AW), &AW));
+  clCheckError(clSetKernelArg(cl.ssdTile, 3, sizeof(lda), &lda));
+  clCheckError(clSetKernelArg(cl.ssdTile, 4, sizeof(bufB), &bufB));
+  clCheckError(clSetKernelArg(cl.ssdTile, 5, sizeof(BH), &BH));
+  clCheckError(clSetKernelArg(cl.ssdTile, 6, sizeof(BW), &BW));
+  clCheckError(clSetKernelArg(cl.ssdTile, 7, sizeof(ldb), &ldb));
+  clCheckError(clSetKernelArg(cl.ssdTile, 8, sizeof(bufGrpSsd), &bufGrpSsd));
+  clCheckError(clSetKernelArg(cl.ssdTile, 9, sizeof(bufGrpPos), &bufGrpPos));
+
+  clCheckError(
+      clSetKernelArg(cl.reduceBest, 0, sizeof(bufGrpSsd), &bufGrpSsd));
+  clCheckError(
+      clSetKernelArg(cl.reduceBest, 1, sizeof(bufGrpPos), &bufGrpPos));
+  clCheckError(clSetKernelArg(cl.reduceBest, 2, sizeof(groupN), &groupN));
+  clCheckError(
+      clSetKernelArg(cl.reduceBest, 3, sizeof(bufResSsd), &bufResSsd));
+  clCheckError(
+      clSetKernelArg(cl.reduceBest, 4, sizeof(bufResPos), &bufResPos));
+
+  // dim 0 runs along sj so that a work-group reads rows of A
+  size_t globalTile[2] = {groupsW * cl.tileW, groupsH * cl.tileH};
+  size_t localTile[2] = {cl.tileW, cl.tileH};
+  clCheckError(clEnqueueNDRangeKernel(cl.queue, cl.ssdTile, 2, NULL,
+                                      globalTile, localTile, 0, NULL, NULL));
+  clCheckError(clEnqueueNDRangeKernel(cl.queue, cl.reduceBest, 1, NULL,
+                                      &cl.redWG, &cl.redWG, 0, NULL, NULL));
+
+  // retrieve result: device -> host
+  cl_ulong ssd = 0;
+  cl_int2 pos;
+  clCheckError(clEnqueueReadBuffer(cl.queue, bufResSsd, CL_TRUE, 0,
+                                   sizeof(ssd), &ssd, 0, NULL, NULL));
+  clCheckError(clEnqueueReadBuffer(cl.queue, bufResPos, CL_TRUE, 0,
+                                   sizeof(pos), &pos, 0, NULL, NULL));
+  clCheckError(clFinish(cl.queue));
+
+  clReleaseMemObject(bufResPos);
+  clReleaseMemObject(bufResSsd);
+  clReleaseMemObject(bufGrpPos);
+  clReleaseMemObject(bufGrpSsd);
+  clReleaseMemObject(bufB);
+  clReleaseMemObject(bufA);
+
+  // {min_diff, best_x, best_y}
+  return (struct ssd3tuple){(int64_t)ssd, pos.s[0], pos.s[1]};
+}
+
+// vim: sw=2
@@ -0,0 +1,48 @@
+#include "match.h"
+#include "ssd.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+struct ssd3tuple match_direct(const struct image *A, const struct image *B) {
+  int BH = B->h, BW = B->w;
+  int RH = A->h - BH + 1, RW = A->w - BW + 1;
+  int ntw = (RW + TILE_W - 1) / TILE_W;
+  int ntile = (RH + TILE_H - 1) / TILE_H * ntw;
+
+  // {min_diff, best_x, best_y}
+  struct ssd3tuple best = {INT64_MAX, -1, -1};
+#pragma omp parallel for schedule(dynamic) reduction(min3tuple : best)
+  for (int t = 0; t < ntile; t++) {
+    int si0 = t / ntw * TILE_H, sj0 = t % ntw * TILE_W;
+    int si1 = si0 + TILE_H < RH ? si0 + TILE_H : RH;
+    int sj1 = sj0 + TILE_W < RW ? sj0 + TILE_W : RW;
+    for (int si = si0; si < si1; si++) {
+      for (int sj = sj0; sj < sj1; sj++) {
+        int64_t diff = ssd_window(image_row(A, si) + sj, A->stride, B->pixels,
+                                  B->stride, BH, BW);
+
+        log("si=%d sj=%d diff=%" PRId64 " best_x=%d best_y=%d "
+            "min_diff=%" PRId64,
+            si, sj, diff, best.y, best.z, best.x);
+
+        struct ssd3tuple cand = {diff, si, sj};
+        if (cmp3tuple(cand, best) < 0) {
+          best = cand;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+// vim: sw=2
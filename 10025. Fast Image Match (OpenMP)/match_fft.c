@@ -0,0 +1,195 @@
+#include "match.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+// columns transformed together by one thread, so that gathering a column
+// touches whole cache lines of the row-major buffer
+#define COL_BATCH 8
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct cplx {
+  double re, im;
+};
+
+static int ceilpow2(int x) {
+  int n = 1;
+  while (n < x)
+    n *= 2;
+  return n;
+}
+
+// tw[k] = exp(-2 pi i k / n), k < n / 2
+static struct cplx *make_twiddles(int n) {
+  struct cplx *tw = malloc(sizeof(struct cplx) * (size_t)(n / 2 + 1));
+  for (int k = 0; k < n / 2; k++) {
+    // computed directly rather than by recurrence to keep the error at
+    // machine epsilon, which is what makes rounding the correlation exact
+    double theta = -2.0 * M_PI * k / n;
+    tw[k].re = cos(theta);
+    tw[k].im = sin(theta);
+  }
+  return tw;
+}
+
+// in-place iterative radix-2 FFT, conj(tw) is used when inverse
+static void fft(struct cplx *x, int n, const struct cplx *tw, int inverse) {
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      struct cplx t = x[i];
+      x[i] = x[j];
+      x[j] = t;
+    }
+  }
+
+  for (int len = 2; len <= n; len *= 2) {
+    int half = len / 2, step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < half; k++) {
+        struct cplx w = tw[k * step];
+        if (inverse)
+          w.im = -w.im;
+        struct cplx u = x[i + k], v = x[i + k + half];
+        struct cplx vw = {v.re * w.re - v.im * w.im, v.re * w.im + v.im * w.re};
+        x[i + k] = (struct cplx){u.re + vw.re, u.im + vw.im};
+        x[i + k + half] = (struct cplx){u.re - vw.re, u.im - vw.im};
+      }
+    }
+  }
+}
+
+// 2-D FFT of the P x Q row-major buffer z
+static void fft2(struct cplx *z, int P, int Q, const struct cplx *twP,
+                 const struct cplx *twQ, int inverse) {
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < P; i++)
+    fft(z + (long)i * Q, Q, twQ, inverse);
+
+#pragma omp parallel
+  {
+    struct cplx *col = malloc(sizeof(struct cplx) * (size_t)(COL_BATCH * P));
+#pragma omp for schedule(static)
+    for (int sj = 0; sj < Q; sj += COL_BATCH) {
+      int nc = Q - sj < COL_BATCH ? Q - sj : COL_BATCH;
+      for (int i = 0; i < P; i++)
+        for (int c = 0; c < nc; c++)
+          col[c * P + i] = z[(long)i * Q + sj + c];
+      for (int c = 0; c < nc; c++)
+        fft(col + c * P, P, twP, inverse);
+      for (int i = 0; i < P; i++)
+        for (int c = 0; c < nc; c++)
+          z[(long)i * Q + sj + c] = col[c * P + i];
+    }
+    free(col);
+  }
+}
+
+struct ssd3tuple match_fft(const struct image *A, const struct image *B) {
+  int AH = A->h, AW = A->w, BH = B->h, BW = B->w;
+  int RH = AH - BH + 1, RW = AW - BW + 1;
+
+  // A is not padded: valid windows never wrap around a P x Q circular
+  // correlation as long as P >= AH and Q >= AW
+  int P = ceilpow2(AH), Q = ceilpow2(AW);
+  log("match_fft AH=%d AW=%d BH=%d BW=%d P=%d Q=%d", AH, AW, BH, BW, P, Q);
+
+  struct cplx *twP = make_twiddles(P);
+  struct cplx *twQ = make_twiddles(Q);
+  struct cplx *z = calloc((size_t)P * (size_t)Q, sizeof(struct cplx));
+  struct cplx *x = malloc(sizeof(struct cplx) * (size_t)P * (size_t)Q);
+
+  // both real inputs share one complex transform: z = A + iB
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < AH; i++) {
+    const uint8_t *arow = image_row(A, i);
+    for (int j = 0; j < AW; j++)
+      z[(long)i * Q + j].re = arow[j];
+    if (i < BH) {
+      const uint8_t *brow = image_row(B, i);
+      for (int j = 0; j < BW; j++)
+        z[(long)i * Q + j].im = brow[j];
+    }
+  }
+  fft2(z, P, Q, twP, twQ, 0);
+
+  // split: FA[k] = (Z[k] + conj(Z[-k])) / 2, FB[k] = (Z[k] - conj(Z[-k])) / 2i
+  // correlation: X[k] = FA[k] conj(FB[k])
+#pragma omp parallel for schedule(static)
+  for (int u = 0; u < P; u++) {
+    int nu = (P - u) & (P - 1);
+    for (int v = 0; v < Q; v++) {
+      int nv = (Q - v) & (Q - 1);
+      struct cplx zk = z[(long)u * Q + v], zn = z[(long)nu * Q + nv];
+      struct cplx fa = {(zk.re + zn.re) / 2, (zk.im - zn.im) / 2};
+      struct cplx fb = {(zk.im + zn.im) / 2, (zn.re - zk.re) / 2};
+      x[(long)u * Q + v] = (struct cplx){fa.re * fb.re + fa.im * fb.im,
+                                         fa.im * fb.re - fa.re * fb.im};
+    }
+  }
+  fft2(x, P, Q, twP, twQ, 1);
+
+  // summed-area table of A^2, sat[i][j] = sum over A[0..i)[0..j)
+  int64_t *sat = calloc((size_t)(AH + 1) * (size_t)(AW + 1), sizeof(int64_t));
+  for (int i = 0; i < AH; i++) {
+    const uint8_t *arow = image_row(A, i);
+    int64_t row = 0;
+    for (int j = 0; j < AW; j++) {
+      row += arow[j] * arow[j];
+      sat[(long)(i + 1) * (AW + 1) + j + 1] =
+          sat[(long)i * (AW + 1) + j + 1] + row;
+    }
+  }
+
+  int64_t sumb2 = 0;
+  for (int i = 0; i < BH; i++) {
+    const uint8_t *brow = image_row(B, i);
+    for (int j = 0; j < BW; j++)
+      sumb2 += brow[j] * brow[j];
+  }
+
+  double scale = 1.0 / ((double)P * Q);
+
+  // {min_diff, best_x, best_y}
+  struct ssd3tuple best = {INT64_MAX, -1, -1};
+#pragma omp parallel for reduction(min3tuple : best)
+  for (int si = 0; si < RH; si++) {
+    const int64_t *top = sat + (long)si * (AW + 1);
+    const int64_t *bot = sat + (long)(si + BH) * (AW + 1);
+    for (int sj = 0; sj < RW; sj++) {
+      int64_t suma2 = bot[sj + BW] - bot[sj] - top[sj + BW] + top[sj];
+      int64_t sumab = llround(x[(long)si * Q + sj].re * scale);
+      int64_t ssd = suma2 - 2 * sumab + sumb2;
+
+      struct ssd3tuple cand = {ssd, si, sj};
+      if (cmp3tuple(cand, best) < 0) {
+        best = cand;
+      }
+    }
+  }
+
+  free(sat);
+  free(x);
+  free(z);
+  free(twQ);
+  free(twP);
+  return best;
+}
+
+// vim: sw=2
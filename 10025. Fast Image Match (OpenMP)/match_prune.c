@@ -0,0 +1,135 @@
+#include "match.h"
+#include "ssd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+// the bound is checked after each band of consecutive template rows, about
+// this many pixels, so the kernel call and the check are amortized
+#define BAND_PIXELS 1024
+#define MAX_BAND_ROWS 16
+
+struct band_key {
+  long long var; // n^2 times the variance of the n pixels in the band
+  int row;
+};
+
+// high-variance bands first, original order among equals
+static int cmp_band_key(const void *a_, const void *b_) {
+  const struct band_key *a = a_, *b = b_;
+  if (a->var != b->var)
+    return a->var > b->var ? -1 : 1;
+  return a->row - b->row;
+}
+
+// Flat template rows match almost anything of the same brightness, while
+// rows with a lot of contrast are unlikely to line up by chance, so they
+// push a bad candidate over the bound within the first few bands.
+// order[] receives the first row of each band, returns the number of bands.
+static int order_bands(const struct image *B, int band_rows, int *order) {
+  int nband = (B->h + band_rows - 1) / band_rows;
+  struct band_key *keys = malloc(sizeof(struct band_key) * (size_t)nband);
+  for (int k = 0; k < nband; k++) {
+    int r0 = k * band_rows;
+    int r1 = r0 + band_rows < B->h ? r0 + band_rows : B->h;
+    long long s = 0, s2 = 0, n = (long long)(r1 - r0) * B->w;
+    for (int i = r0; i < r1; i++) {
+      const uint8_t *brow = image_row(B, i);
+      for (int j = 0; j < B->w; j++) {
+        s += brow[j];
+        s2 += brow[j] * brow[j];
+      }
+    }
+    keys[k].var = s2 * n - s * s;
+    keys[k].row = r0;
+  }
+  qsort(keys, (size_t)nband, sizeof(struct band_key), cmp_band_key);
+  for (int k = 0; k < nband; k++)
+    order[k] = keys[k].row;
+  free(keys);
+  return nband;
+}
+
+// lower *bound to val if smaller, lock-free
+static inline void bound_update(int64_t *bound, int64_t val) {
+  int64_t cur = __atomic_load_n(bound, __ATOMIC_RELAXED);
+  while (val < cur && !__atomic_compare_exchange_n(bound, &cur, val, 1,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED))
+    ;
+}
+
+struct ssd3tuple match_prune_bound(const struct image *A,
+                                   const struct image *B, int64_t bound) {
+  int BH = B->h, BW = B->w;
+  int RH = A->h - BH + 1, RW = A->w - BW + 1;
+  int ntw = (RW + TILE_W - 1) / TILE_W;
+  int ntile = (RH + TILE_H - 1) / TILE_H * ntw;
+
+  int band_rows = (BAND_PIXELS + BW - 1) / BW;
+  if (band_rows > MAX_BAND_ROWS)
+    band_rows = MAX_BAND_ROWS;
+  int *order = malloc(sizeof(int) * (size_t)BH);
+  int nband = order_bands(B, band_rows, order);
+
+  // bound: best complete SSD seen by any thread so far; a candidate is
+  // dropped once its partial sum exceeds it. Ties must survive (the position
+  // decides), so the test is strictly greater.
+  long long rows_done = 0;
+
+  // {min_diff, best_x, best_y}
+  struct ssd3tuple best = {INT64_MAX, -1, -1};
+#pragma omp parallel for schedule(dynamic) reduction(min3tuple : best)         \
+    reduction(+ : rows_done)
+  for (int t = 0; t < ntile; t++) {
+    int si0 = t / ntw * TILE_H, sj0 = t % ntw * TILE_W;
+    int si1 = si0 + TILE_H < RH ? si0 + TILE_H : RH;
+    int sj1 = sj0 + TILE_W < RW ? sj0 + TILE_W : RW;
+    for (int si = si0; si < si1; si++) {
+      for (int sj = sj0; sj < sj1; sj++) {
+        int64_t diff = 0;
+        int k = 0, rows = 0;
+        for (; k < nband; k++) {
+          int r = order[k];
+          int h = r + band_rows < BH ? band_rows : BH - r;
+          diff += ssd_window(image_row(A, si + r) + sj, A->stride,
+                             image_row(B, r), B->stride, h, BW);
+          rows += h;
+          if (diff > __atomic_load_n(&bound, __ATOMIC_RELAXED))
+            break;
+        }
+        rows_done += rows;
+        if (k < nband)
+          continue;
+
+        bound_update(&bound, diff);
+        struct ssd3tuple cand = {diff, si, sj};
+        if (cmp3tuple(cand, best) < 0) {
+          best = cand;
+        }
+      }
+    }
+  }
+
+  log("match_prune visited %lld of %lld rows", rows_done,
+      (long long)RH * RW * BH);
+  (void)rows_done;
+
+  free(order);
+  return best;
+}
+
+struct ssd3tuple match_prune(const struct image *A, const struct image *B) {
+  return match_prune_bound(A, B, INT64_MAX);
+}
+
+// vim: sw=2
@@ -0,0 +1,135 @@
+#include "match.h"
+#include "ssd.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define MAX_LEVEL 3    // 2x, 4x, 8x
+#define MIN_TEMPLATE 8 // smallest template side worth searching at a level
+#define TOP_K 8        // candidates carried to the next finer level
+#define RADIUS 1       // extra coarse pixels of slack around each candidate
+
+// 2x2 box filter, rounded
+static uint8_t *downsample(const struct image *src, struct image *dst) {
+  int h = src->h / 2, w = src->w / 2;
+  uint8_t *buf = malloc((size_t)h * (size_t)w + 1);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < h; i++) {
+    const uint8_t *r0 = image_row(src, 2 * i);
+    const uint8_t *r1 = image_row(src, 2 * i + 1);
+    for (int j = 0; j < w; j++)
+      buf[(long)i * w + j] =
+          (uint8_t)((r0[2 * j] + r0[2 * j + 1] + r1[2 * j] + r1[2 * j + 1] +
+                     2) /
+                    4);
+  }
+  *dst = (struct image){h, w, w, buf};
+  return buf;
+}
+
+static int cmp3tuple_qsort(const void *a, const void *b) {
+  return cmp3tuple(*(const struct ssd3tuple *)a,
+                   *(const struct ssd3tuple *)b);
+}
+
+// score cands[0..n) in place, sort them and drop duplicates,
+// returns the number of distinct candidates
+static int score_sort(const struct image *A, const struct image *B,
+                      struct ssd3tuple *cands, int n) {
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int c = 0; c < n; c++)
+    cands[c].x = ssd_window(image_row(A, cands[c].y) + cands[c].z, A->stride,
+                            B->pixels, B->stride, B->h, B->w);
+  qsort(cands, (size_t)n, sizeof(struct ssd3tuple), cmp3tuple_qsort);
+  int m = 0;
+  for (int c = 0; c < n; c++)
+    if (m == 0 || cmp3tuple(cands[m - 1], cands[c]) != 0)
+      cands[m++] = cands[c];
+  return m;
+}
+
+struct ssd3tuple match_pyramid(const struct image *A, const struct image *B) {
+  // no position at all: the empty result of the other engines. Halving keeps
+  // A at least as large as B, so every level then has a candidate.
+  if (A->h - B->h + 1 <= 0 || A->w - B->w + 1 <= 0)
+    return (struct ssd3tuple){INT64_MAX, -1, -1};
+
+  int levels = 0;
+  while (levels < MAX_LEVEL && (B->h >> (levels + 1)) >= MIN_TEMPLATE &&
+         (B->w >> (levels + 1)) >= MIN_TEMPLATE)
+    levels++;
+  if (levels == 0)
+    return match_prune(A, B);
+
+  // level 0 is the input itself
+  struct image pa[MAX_LEVEL + 1], pb[MAX_LEVEL + 1];
+  uint8_t *bufs[2 * MAX_LEVEL];
+  pa[0] = *A;
+  pb[0] = *B;
+  for (int l = 1; l <= levels; l++) {
+    bufs[2 * l - 2] = downsample(&pa[l - 1], &pa[l]);
+    bufs[2 * l - 1] = downsample(&pb[l - 1], &pb[l]);
+  }
+
+  // exhaustive at the coarsest level
+  int RH = pa[levels].h - pb[levels].h + 1;
+  int RW = pa[levels].w - pb[levels].w + 1;
+  int cap = RH * RW;
+  if (cap < TOP_K * (2 * RADIUS + 2) * (2 * RADIUS + 2))
+    cap = TOP_K * (2 * RADIUS + 2) * (2 * RADIUS + 2);
+  struct ssd3tuple *cands = malloc(sizeof(struct ssd3tuple) * (size_t)cap);
+  int n = 0;
+  for (int y = 0; y < RH; y++)
+    for (int x = 0; x < RW; x++)
+      cands[n++] = (struct ssd3tuple){0, y, x};
+  n = score_sort(&pa[levels], &pb[levels], cands, n);
+  log("match_pyramid levels=%d coarse %dx%d best=(%d,%d) ssd=%" PRId64,
+      levels, RH, RW, cands[0].y, cands[0].z, cands[0].x);
+
+  // each finer level only looks at the children of the best TOP_K
+  for (int l = levels - 1; l >= 0; l--) {
+    int k = n < TOP_K ? n : TOP_K;
+    struct ssd3tuple top[TOP_K];
+    for (int c = 0; c < k; c++)
+      top[c] = cands[c];
+
+    RH = pa[l].h - pb[l].h + 1;
+    RW = pa[l].w - pb[l].w + 1;
+    n = 0;
+    for (int c = 0; c < k; c++) {
+      for (int dy = -RADIUS; dy <= 1 + RADIUS; dy++) {
+        for (int dx = -RADIUS; dx <= 1 + RADIUS; dx++) {
+          int y = 2 * top[c].y + dy, x = 2 * top[c].z + dx;
+          if (y >= 0 && y < RH && x >= 0 && x < RW)
+            cands[n++] = (struct ssd3tuple){0, y, x};
+        }
+      }
+    }
+    n = score_sort(&pa[l], &pb[l], cands, n);
+    log("match_pyramid level=%d best=(%d,%d) ssd=%" PRId64, l, cands[0].y,
+        cands[0].z, cands[0].x);
+  }
+
+  // the refined best is only a guess; using its SSD as the initial bound of
+  // the branch-and-bound search prunes nearly every other candidate within
+  // its first band, and whatever survives is scored in full, so the result
+  // is exactly the exhaustive one
+  struct ssd3tuple best = match_prune_bound(A, B, cands[0].x);
+
+  free(cands);
+  for (int i = 0; i < 2 * levels; i++)
+    free(bufs[i]);
+  return best;
+}
+
+// vim: sw=2
@@ -0,0 +1,145 @@
+#include "match.h"
+#include "ssd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+// max-heap under cmp3tuple: v[0] is the worst match kept so far
+struct heap {
+  struct ssd3tuple *v;
+  int n, cap;
+};
+
+static void heap_push(struct heap *h, struct ssd3tuple x) {
+  if (h->n == h->cap) {
+    h->cap = h->cap ? 2 * h->cap : 64;
+    h->v = realloc(h->v, sizeof(struct ssd3tuple) * (size_t)h->cap);
+  }
+  int i = h->n++;
+  while (i > 0 && cmp3tuple(h->v[(i - 1) / 2], x) < 0) {
+    h->v[i] = h->v[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->v[i] = x;
+}
+
+// replace the worst match by x
+static void heap_replace_top(struct heap *h, struct ssd3tuple x) {
+  int i = 0;
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= h->n)
+      break;
+    if (c + 1 < h->n && cmp3tuple(h->v[c], h->v[c + 1]) < 0)
+      c++;
+    if (cmp3tuple(x, h->v[c]) >= 0)
+      break;
+    h->v[i] = h->v[c];
+    i = c;
+  }
+  h->v[i] = x;
+}
+
+static int cmp3tuple_qsort(const void *a, const void *b) {
+  return cmp3tuple(*(const struct ssd3tuple *)a,
+                   *(const struct ssd3tuple *)b);
+}
+
+// merge sorted a[0..na) and b[0..nb) into out, keeping at most k (<= 0: all)
+static int merge(const struct ssd3tuple *a, int na, const struct ssd3tuple *b,
+                 int nb, struct ssd3tuple *out, int k) {
+  int n = 0, i = 0, j = 0;
+  while ((i < na || j < nb) && (k <= 0 || n < k)) {
+    if (j == nb || (i < na && cmp3tuple(a[i], b[j]) < 0))
+      out[n++] = a[i++];
+    else
+      out[n++] = b[j++];
+  }
+  return n;
+}
+
+int match_topk(const struct image *A, const struct image *B, int k,
+               int64_t threshold, struct ssd3tuple **out) {
+  int BH = B->h, BW = B->w;
+  int RH = A->h - BH + 1, RW = A->w - BW + 1;
+  int ntw = (RW + TILE_W - 1) / TILE_W;
+  int ntile = (RH + TILE_H - 1) / TILE_H * ntw;
+
+#ifdef _OPENMP
+  int nthread = omp_get_max_threads();
+#else
+  int nthread = 1;
+#endif
+  struct heap *heaps = calloc((size_t)nthread, sizeof(struct heap));
+
+#pragma omp parallel
+  {
+#ifdef _OPENMP
+    struct heap *h = &heaps[omp_get_thread_num()];
+#else
+    struct heap *h = &heaps[0];
+#endif
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < ntile; t++) {
+      int si0 = t / ntw * TILE_H, sj0 = t % ntw * TILE_W;
+      int si1 = si0 + TILE_H < RH ? si0 + TILE_H : RH;
+      int sj1 = sj0 + TILE_W < RW ? sj0 + TILE_W : RW;
+      for (int si = si0; si < si1; si++) {
+        for (int sj = sj0; sj < sj1; sj++) {
+          int64_t diff = ssd_window(image_row(A, si) + sj, A->stride,
+                                    B->pixels, B->stride, BH, BW);
+          if (diff > threshold)
+            continue;
+          struct ssd3tuple cand = {diff, si, sj};
+          if (k <= 0 || h->n < k)
+            heap_push(h, cand);
+          else if (cmp3tuple(cand, h->v[0]) < 0)
+            heap_replace_top(h, cand);
+        }
+      }
+    }
+
+    // each thread sorts its own heap, then the sorted lists are merged
+    // pairwise in a tree, log2(nthread) rounds with the pairs in parallel
+    // (an empty heap may have no array at all, which qsort must not see)
+    if (h->n > 1)
+      qsort(h->v, (size_t)h->n, sizeof(struct ssd3tuple), cmp3tuple_qsort);
+  }
+
+  for (int step = 1; step < nthread; step *= 2) {
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nthread - step; i += 2 * step) {
+      struct heap *a = &heaps[i], *b = &heaps[i + step];
+      int cap = a->n + b->n;
+      struct ssd3tuple *v = malloc(sizeof(struct ssd3tuple) * (size_t)(cap + 1));
+      int n = merge(a->v, a->n, b->v, b->n, v, k);
+      free(a->v);
+      free(b->v);
+      *a = (struct heap){v, n, cap + 1};
+      *b = (struct heap){NULL, 0, 0};
+    }
+  }
+  log("match_topk k=%d threshold=%lld found=%d", k, (long long)threshold,
+      heaps[0].n);
+
+  int n = heaps[0].n;
+  *out = heaps[0].v;
+  free(heaps);
+  return n;
+}
+
+// vim: sw=2
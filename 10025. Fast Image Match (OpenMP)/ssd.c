@@ -0,0 +1,198 @@
+#include "ssd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SSD_X86
+#include <immintrin.h>
+#endif
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+static int64_t ssd_scalar(const uint8_t *a, int lda, const uint8_t *b,
+                          int ldb, int h, int w) {
+  int64_t diff = 0;
+  for (int i = 0; i < h; i++) {
+    const uint8_t *arow = a + (long)i * lda;
+    const uint8_t *brow = b + (long)i * ldb;
+    for (int j = 0; j < w; j++) {
+      int d = arow[j] - brow[j];
+      diff += d * d;
+    }
+  }
+  return diff;
+}
+
+#ifdef SSD_X86
+
+// Both kernels take |a - b| on bytes with two saturating subtractions, widen
+// to 16-bit by unpacking with zero, and square-and-add adjacent pairs into
+// 32-bit lanes with madd. A 32-bit lane gains at most 2 * 2 * 255^2 per
+// vector of pixels, so the lanes are flushed into 64-bit lanes every
+// FLUSH_PIXELS pixels, well before they could wrap: inside a row for wide
+// rows, and at the end of each row, after the tails, for tall narrow ones.
+#define FLUSH_PIXELS (1 << 16)
+
+// acc64 + the 32-bit lanes of acc, widened
+__attribute__((target("avx2"))) static inline __m256i flush_avx2(__m256i acc64,
+                                                                 __m256i acc) {
+  acc64 = _mm256_add_epi64(acc64,
+                           _mm256_cvtepu32_epi64(_mm256_castsi256_si128(acc)));
+  return _mm256_add_epi64(
+      acc64, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(acc, 1)));
+}
+
+__attribute__((target("avx2"))) static int64_t
+ssd_avx2(const uint8_t *a, int lda, const uint8_t *b, int ldb, int h, int w) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  __m256i acc64 = _mm256_setzero_si256();
+  int64_t diff = 0;
+  int pending = 0;
+  for (int i = 0; i < h; i++) {
+    const uint8_t *arow = a + (long)i * lda;
+    const uint8_t *brow = b + (long)i * ldb;
+    int j = 0;
+    for (; j + 32 <= w; j += 32) {
+      __m256i va = _mm256_loadu_si256((const __m256i *)(arow + j));
+      __m256i vb = _mm256_loadu_si256((const __m256i *)(brow + j));
+      __m256i d =
+          _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+      __m256i lo = _mm256_unpacklo_epi8(d, zero);
+      __m256i hi = _mm256_unpackhi_epi8(d, zero);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+      if ((pending += 32) >= FLUSH_PIXELS) {
+        acc64 = flush_avx2(acc64, acc);
+        acc = _mm256_setzero_si256();
+        pending = 0;
+      }
+    }
+    for (; j + 16 <= w; j += 16) {
+      __m256i va = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(arow + j)));
+      __m256i vb = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(brow + j)));
+      __m256i d = _mm256_sub_epi16(va, vb);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+      pending += 16;
+    }
+    for (; j + 8 <= w; j += 8) {
+      __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(arow + j)));
+      __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(brow + j)));
+      __m128i d = _mm_sub_epi16(va, vb);
+      acc = _mm256_add_epi32(acc,
+                             _mm256_zextsi128_si256(_mm_madd_epi16(d, d)));
+      pending += 8;
+    }
+    for (; j < w; j++) {
+      int d = arow[j] - brow[j];
+      diff += d * d;
+    }
+    if (pending >= FLUSH_PIXELS) {
+      acc64 = flush_avx2(acc64, acc);
+      acc = _mm256_setzero_si256();
+      pending = 0;
+    }
+  }
+  acc64 = flush_avx2(acc64, acc);
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc64),
+                            _mm256_extracti128_si256(acc64, 1));
+  s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+  return diff + _mm_cvtsi128_si64(s);
+}
+
+__attribute__((target("avx512f"))) static inline __m512i
+flush_avx512(__m512i acc64, __m512i acc) {
+  acc64 = _mm512_add_epi64(acc64,
+                           _mm512_cvtepu32_epi64(_mm512_castsi512_si256(acc)));
+  return _mm512_add_epi64(
+      acc64, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(acc, 1)));
+}
+
+// the ragged end of each row is a masked load, so no scalar tail
+__attribute__((target("avx512f,avx512bw"))) static int64_t
+ssd_avx512(const uint8_t *a, int lda, const uint8_t *b, int ldb, int h, int w) {
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i acc = _mm512_setzero_si512();
+  __m512i acc64 = _mm512_setzero_si512();
+  int pending = 0;
+  __mmask64 tail = w % 64 ? (__mmask64)(~0ULL >> (64 - w % 64)) : 0;
+  for (int i = 0; i < h; i++) {
+    const uint8_t *arow = a + (long)i * lda;
+    const uint8_t *brow = b + (long)i * ldb;
+    int j = 0;
+    for (; j + 64 <= w; j += 64) {
+      __m512i va = _mm512_loadu_si512(arow + j);
+      __m512i vb = _mm512_loadu_si512(brow + j);
+      __m512i d =
+          _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+      __m512i lo = _mm512_unpacklo_epi8(d, zero);
+      __m512i hi = _mm512_unpackhi_epi8(d, zero);
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+      if ((pending += 64) >= FLUSH_PIXELS) {
+        acc64 = flush_avx512(acc64, acc);
+        acc = _mm512_setzero_si512();
+        pending = 0;
+      }
+    }
+    if (tail) {
+      __m512i va = _mm512_maskz_loadu_epi8(tail, arow + j);
+      __m512i vb = _mm512_maskz_loadu_epi8(tail, brow + j);
+      __m512i d =
+          _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+      __m512i lo = _mm512_unpacklo_epi8(d, zero);
+      __m512i hi = _mm512_unpackhi_epi8(d, zero);
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+      pending += w % 64;
+    }
+    if (pending >= FLUSH_PIXELS) {
+      acc64 = flush_avx512(acc64, acc);
+      acc = _mm512_setzero_si512();
+      pending = 0;
+    }
+  }
+  return _mm512_reduce_add_epi64(flush_avx512(acc64, acc));
+}
+
+#endif // SSD_X86
+
+ssd_fn ssd_window = ssd_scalar;
+const char *ssd_kernel_name = "scalar";
+
+__attribute__((constructor)) static void ssd_dispatch(void) {
+  const char *want = getenv("MATCH_SIMD");
+#ifdef SSD_X86
+  __builtin_cpu_init();
+  int has_avx512 =
+      __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  if (want != NULL && strcmp(want, "scalar") == 0)
+    has_avx512 = has_avx2 = 0;
+  if (want != NULL && strcmp(want, "avx2") == 0)
+    has_avx512 = 0;
+  if (has_avx512) {
+    ssd_window = ssd_avx512;
+    ssd_kernel_name = "avx512";
+  } else if (has_avx2) {
+    ssd_window = ssd_avx2;
+    ssd_kernel_name = "avx2";
+  }
+#else
+  (void)want;
+#endif
+  log("ssd kernel: %s", ssd_kernel_name);
+}
+
+// vim: sw=2
@@ -0,0 +1,18 @@
+#ifndef _SSD_H
+#define _SSD_H
+
+#include <stdint.h>
+
+// sum of squared differences of an h x w window
+//   sum over i < h, j < w of (a[i * lda + j] - b[i * ldb + j])^2
+typedef int64_t (*ssd_fn)(const uint8_t *a, int lda, const uint8_t *b,
+                          int ldb, int h, int w);
+
+// best kernel supported by the running CPU, chosen at startup
+// (override with environment variable MATCH_SIMD=scalar|avx2|avx512)
+extern ssd_fn ssd_window;
+
+// name of the kernel ssd_window points to
+extern const char *ssd_kernel_name;
+
+#endif
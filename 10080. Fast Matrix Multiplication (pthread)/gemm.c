@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+
+#include "gemm.h"
+#include "pool.h"
+#include "worksteal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_X86
+#include <immintrin.h>
+#endif
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define ceildivi(x, y)                                                         \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    (_x + _y - 1) / _y;                                                        \
+  })
+
+#define mini(x, y)                                                             \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    _x < _y ? _x : _y;                                                         \
+  })
+
+// KC x NR panel of B stays in L1, MC x KC block of A in L2 and the packed
+// KC x n panel of B in L3; an MC x NC tile of C fits in L2 next to the block
+// of A. MC is a multiple of every kernel's MR and NC of every kernel's NR.
+static struct {
+  int kc, mc, nc;
+} blk = {GEMM_KC, GEMM_MC, GEMM_NC};
+// largest register tile of any kernel
+#define MAX_TILE (12 * 16)
+
+#define ALIGN 64
+
+typedef unsigned long ulong;
+
+// MR x NR tile C (+)= a * b over one kc-deep panel, a packed kc x MR and b
+// packed kc x NR
+typedef void (*kernel_fn)(int kc, const ulong *restrict a,
+                          const ulong *restrict b, ulong *restrict C, int ldc,
+                          int accumulate);
+
+struct kernel {
+  const char *name;
+  int mr, nr;
+  kernel_fn fn;
+};
+
+struct gemm_arg {
+  int m, n, k;
+  const ulong *A;
+  int lda;
+  const ulong *B;
+  int ldb;
+  ulong *C;
+  int ldc;
+
+  const struct kernel *kern;
+  int pc, kc;   // current panel: rows pc .. pc + kc - 1 of B
+  ulong **bp;   // the packed panel, one copy per node when replicated
+  int ncopy;
+  int num_mb, num_nb;
+  struct worksteal_deque *dq; // tiles of each worker
+  int ndq;
+};
+
+// Tiles are numbered row of tiles by row of tiles, so the tiles sharing a
+// packed block of A follow each other. Each worker is dealt the rows of tiles
+// that start in its rows of C (pool_owner()) and steals from the others when
+// it runs out.
+
+// packed panels of B shared by the workers of a parallel gemm(), one per node
+// with MATMUL_REPLICATE=1 and one in total otherwise
+static struct copy {
+  ulong *b;
+  size_t cap;
+} *bpack;
+static int replicate;
+
+// private packing buffers of each worker; gemm_local() packs B into its own
+static struct buffers {
+  ulong *a; // MC x KC block of A
+  size_t a_cap;
+  ulong *b;
+  size_t b_cap;
+} *bufs;
+static pthread_once_t bufs_once = PTHREAD_ONCE_INIT;
+
+static void *xaligned_alloc(size_t n) {
+  void *p;
+  if (posix_memalign(&p, ALIGN, n) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  return p;
+}
+
+// a forked child has a pool of its own, maybe of another size
+static void bufs_fork_child(void) {
+  bufs_once = (pthread_once_t)PTHREAD_ONCE_INIT;
+}
+
+static void register_atfork(void) {
+  pthread_atfork(NULL, NULL, bufs_fork_child);
+}
+
+static void bufs_init(void) {
+  // once per process tree: the registration is inherited by the child
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  pthread_once(&atfork_once, register_atfork);
+  bufs = calloc((size_t)pool_size(), sizeof(struct buffers));
+  bpack = calloc((size_t)pool_nodes(), sizeof(struct copy));
+}
+
+// makes *buf hold at least n elements, dropping its contents
+static void reserve(ulong **buf, size_t *cap, size_t n) {
+  if (n <= *cap)
+    return;
+  free(*buf);
+  *buf = xaligned_alloc(sizeof(ulong) * n);
+  *cap = n;
+}
+
+// rows pc .. pc + kc - 1, columns j0 .. j0 + NR - 1 of B -> kc x NR, padded
+// with zero columns
+static void pack_b_panel(const struct gemm_arg *arg, int j0, ulong *dst) {
+  int kc = arg->kc, NR = arg->kern->nr, nr = mini(NR, arg->n - j0);
+  const ulong *src = arg->B + (size_t)arg->pc * (size_t)arg->ldb + j0;
+  for (int kk = 0; kk < kc; kk++) {
+    int jj = 0;
+    for (; jj < nr; jj++)
+      dst[jj] = src[jj];
+    for (; jj < NR; jj++)
+      dst[jj] = 0;
+    src += arg->ldb;
+    dst += NR;
+  }
+}
+
+// rows i0 .. i0 + mc - 1, columns pc .. pc + kc - 1 of A -> MR-row panels of
+// kc x MR, each stored column by column, padded with zero rows
+static void pack_a_block(const struct gemm_arg *arg, int i0, int mc,
+                         ulong *dst) {
+  int kc = arg->kc, MR = arg->kern->mr;
+  for (int ir = 0; ir < mc; ir += MR) {
+    int mr = mini(MR, mc - ir);
+    const ulong *src = arg->A + (size_t)(i0 + ir) * (size_t)arg->lda + arg->pc;
+    for (int kk = 0; kk < kc; kk++) {
+      int ii = 0;
+      for (; ii < mr; ii++)
+        dst[ii] = src[(size_t)ii * (size_t)arg->lda + (size_t)kk];
+      for (; ii < MR; ii++)
+        dst[ii] = 0;
+      dst += MR;
+    }
+  }
+}
+
+// 8 accumulators plus the operands fit in the 16 general-purpose registers,
+// a 4 x 4 tile spills
+static void kernel_4x2(int kc, const ulong *restrict a,
+                       const ulong *restrict b, ulong *restrict C, int ldc,
+                       int accumulate) {
+  ulong c[4][2] = {{0}};
+  for (int kk = 0; kk < kc; kk++) {
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 2; j++)
+        c[i][j] += a[i] * b[j];
+    }
+    a += 4;
+    b += 2;
+  }
+  for (int i = 0; i < 4; i++) {
+    ulong *Ci = C + (size_t)i * (size_t)ldc;
+    for (int j = 0; j < 2; j++)
+      Ci[j] = accumulate ? Ci[j] + c[i][j] : c[i][j];
+  }
+}
+
+#ifdef GEMM_X86
+
+// When every entry of A and B fits in 32 bits, each product a * b is exact
+// in 64 bits and comes out of a single vpmuludq lane, which only reads the
+// low halves of its 64-bit operands. The packed panels keep their 64-bit
+// layout; sums still wrap modulo 2^64 in vpaddq.
+//
+// Entries that are small negative numbers modulo 2^64, as the differences
+// formed by Strassen's algorithm are, go through the signed vpmuldq instead:
+// the product of two values in [-2^31, 2^31) is exact in 64 bits and
+// congruent to the wrapped product modulo 2^64.
+
+#define mul32_256(sign, x, y)                                                  \
+  ((sign) ? _mm256_mul_epi32((x), (y)) : _mm256_mul_epu32((x), (y)))
+#define mul32_512(sign, x, y)                                                  \
+  ((sign) ? _mm512_mul_epi32((x), (y)) : _mm512_mul_epu32((x), (y)))
+
+// 12 accumulators, 2 rows of B and a broadcast of A: 15 of 16 registers
+__attribute__((target("avx2"), always_inline)) static inline void
+kernel_6x8_avx2(int kc, const ulong *restrict a, const ulong *restrict b,
+                ulong *restrict C, int ldc, int accumulate, int sign) {
+  __m256i c[6][2];
+  for (int i = 0; i < 6; i++)
+    c[i][0] = c[i][1] = _mm256_setzero_si256();
+  for (int kk = 0; kk < kc; kk++) {
+    __m256i b0 = _mm256_load_si256((const __m256i *)b);
+    __m256i b1 = _mm256_load_si256((const __m256i *)(b + 4));
+    for (int i = 0; i < 6; i++) {
+      __m256i ai = _mm256_set1_epi64x((long long)a[i]);
+      c[i][0] = _mm256_add_epi64(c[i][0], mul32_256(sign, ai, b0));
+      c[i][1] = _mm256_add_epi64(c[i][1], mul32_256(sign, ai, b1));
+    }
+    a += 6;
+    b += 8;
+  }
+  for (int i = 0; i < 6; i++) {
+    __m256i *Ci = (__m256i *)(C + (size_t)i * (size_t)ldc);
+    for (int j = 0; j < 2; j++) {
+      __m256i cij = c[i][j];
+      if (accumulate)
+        cij = _mm256_add_epi64(cij, _mm256_loadu_si256(Ci + j));
+      _mm256_storeu_si256(Ci + j, cij);
+    }
+  }
+}
+
+// 24 accumulators of the 32 vector registers
+__attribute__((target("avx512f"), always_inline)) static inline void
+kernel_12x16_avx512(int kc, const ulong *restrict a, const ulong *restrict b,
+                    ulong *restrict C, int ldc, int accumulate, int sign) {
+  __m512i c[12][2];
+  for (int i = 0; i < 12; i++)
+    c[i][0] = c[i][1] = _mm512_setzero_si512();
+  for (int kk = 0; kk < kc; kk++) {
+    __m512i b0 = _mm512_load_si512(b);
+    __m512i b1 = _mm512_load_si512(b + 8);
+    for (int i = 0; i < 12; i++) {
+      __m512i ai = _mm512_set1_epi64((long long)a[i]);
+      c[i][0] = _mm512_add_epi64(c[i][0], mul32_512(sign, ai, b0));
+      c[i][1] = _mm512_add_epi64(c[i][1], mul32_512(sign, ai, b1));
+    }
+    a += 12;
+    b += 16;
+  }
+  for (int i = 0; i < 12; i++) {
+    ulong *Ci = C + (size_t)i * (size_t)ldc;
+    for (int j = 0; j < 2; j++) {
+      __m512i cij = c[i][j];
+      if (accumulate)
+        cij = _mm512_add_epi64(cij, _mm512_loadu_si512(Ci + 8 * j));
+      _mm512_storeu_si512(Ci + 8 * j, cij);
+    }
+  }
+}
+
+#define KERNEL_VARIANTS(name, isa)                                             \
+  __attribute__((target(isa))) static void name##_u32(                      \
+      int kc, const ulong *restrict a, const ulong *restrict b,                \
+      ulong *restrict C, int ldc, int accumulate) {                            \
+    name(kc, a, b, C, ldc, accumulate, 0);                                     \
+  }                                                                            \
+  __attribute__((target(isa))) static void name##_s32(                      \
+      int kc, const ulong *restrict a, const ulong *restrict b,                \
+      ulong *restrict C, int ldc, int accumulate) {                            \
+    name(kc, a, b, C, ldc, accumulate, 1);                                     \
+  }
+
+KERNEL_VARIANTS(kernel_6x8_avx2, "avx2")
+KERNEL_VARIANTS(kernel_12x16_avx512, "avx512f")
+
+#endif // GEMM_X86
+
+static const struct kernel kernel_generic = {"generic", 4, 2, kernel_4x2};
+// kernels for entries in [0, 2^32) and in [-2^31, 2^31), chosen at startup
+static struct kernel kernel_u32 = {"generic", 4, 2, kernel_4x2};
+static struct kernel kernel_s32 = {"generic", 4, 2, kernel_4x2};
+
+// runs the kernel on an mr x nr corner of C through a full-size scratch tile
+static void kernel_edge(const struct kernel *kern, int kc, const ulong *a,
+                        const ulong *b, ulong *C, int ldc, int mr, int nr,
+                        int accumulate) {
+  ulong tile[MAX_TILE] __attribute__((aligned(ALIGN)));
+  kern->fn(kc, a, b, tile, kern->nr, 0);
+  for (int i = 0; i < mr; i++) {
+    ulong *Ci = C + (size_t)i * (size_t)ldc;
+    for (int j = 0; j < nr; j++)
+      Ci[j] = accumulate ? Ci[j] + tile[i * kern->nr + j] : tile[i * kern->nr + j];
+  }
+}
+
+// pool job: pack the current panel of B, NR columns at a time; with
+// replication the workers of each node fill their node's copy
+static void pack_b_worker(void *arg_, int tid, int nthread) {
+  const struct gemm_arg *arg = arg_;
+  int copy = 0, rank = tid, size = nthread;
+  if (arg->ncopy > 1) {
+    copy = pool_node(tid);
+    rank = pool_node_rank(tid);
+    size = pool_node_size(copy);
+  }
+  int NR = arg->kern->nr;
+  int num_panel = ceildivi(arg->n, NR);
+  int per_thread = ceildivi(num_panel, size);
+  int p0 = rank * per_thread, p1 = mini(num_panel, p0 + per_thread);
+  for (int p = p0; p < p1; p++)
+    pack_b_panel(arg, p * NR,
+                 arg->bp[copy] + (size_t)p * (size_t)arg->kc * (size_t)NR);
+}
+
+// pool job: take MC x NC tiles of C and repack A only when the row of tiles
+// changes
+static void multiply_worker(void *arg_, int tid, int nthread) {
+  struct gemm_arg *arg = arg_;
+  const struct kernel *kern = arg->kern;
+  int kc = arg->kc, accumulate = arg->pc > 0;
+  int MR = kern->mr, NR = kern->nr;
+  const ulong *bp = arg->bp[arg->ncopy > 1 ? pool_node(tid) : 0];
+  (void)nthread;
+
+  reserve(&bufs[tid].a, &bufs[tid].a_cap, (size_t)blk.mc * (size_t)blk.kc);
+  ulong *ap = bufs[tid].a;
+  int packed = -1;
+
+  for (;;) {
+    int t = worksteal_next(arg->dq, arg->ndq, arg->ndq > 1 ? tid : 0);
+    if (t < 0)
+      break;
+    int mb = t / arg->num_nb, nb = t % arg->num_nb;
+    int i0 = mb * blk.mc, mc = mini(blk.mc, arg->m - i0);
+    int j0 = nb * blk.nc, nc = mini(blk.nc, arg->n - j0);
+    log("multiply_worker tid=%d pc=%d i0=%d j0=%d", tid, arg->pc, i0, j0);
+
+    if (packed != mb) {
+      pack_a_block(arg, i0, mc, ap);
+      packed = mb;
+    }
+
+    for (int jr = 0; jr < nc; jr += NR) {
+      const ulong *b = bp + (size_t)(j0 + jr) * (size_t)kc;
+      for (int ir = 0; ir < mc; ir += MR) {
+        ulong *C = arg->C + (size_t)(i0 + ir) * (size_t)arg->ldc + j0 + jr;
+        const ulong *a = ap + (size_t)ir * (size_t)kc;
+        if (ir + MR <= mc && jr + NR <= nc)
+          kern->fn(kc, a, b, C, arg->ldc, accumulate);
+        else
+          kernel_edge(kern, kc, a, b, C, arg->ldc, mini(MR, mc - ir),
+                      mini(NR, nc - jr), accumulate);
+      }
+    }
+  }
+}
+
+#define FITS_U32 1 // every entry in [0, 2^32)
+#define FITS_S32 2 // every entry in [-2^31, 2^31) as a signed number
+
+static int fits32(int m, int n, const ulong *X, int ldx) {
+  ulong any = 0, shifted = 0;
+  for (int i = 0; i < m; i++) {
+    const ulong *Xi = X + (size_t)i * (size_t)ldx;
+    for (int j = 0; j < n; j++) {
+      any |= Xi[j];
+      shifted |= Xi[j] + (1UL << 31);
+    }
+  }
+  return (any >> 32 == 0 ? FITS_U32 : 0) | (shifted >> 32 == 0 ? FITS_S32 : 0);
+}
+
+static const struct kernel *choose_kernel(int m, int n, int k, const ulong *A,
+                                          int lda, const ulong *B, int ldb) {
+  int fits = fits32(m, k, A, lda) & fits32(k, n, B, ldb);
+  if (fits & FITS_U32)
+    return &kernel_u32;
+  if (fits & FITS_S32)
+    return &kernel_s32;
+  return &kernel_generic;
+}
+
+__attribute__((constructor)) static void gemm_dispatch(void) {
+  const char *env = getenv("MATMUL_REPLICATE");
+  replicate = env != NULL && strcmp(env, "0") != 0;
+
+  const char *want = getenv("MATMUL_SIMD");
+#ifdef GEMM_X86
+  __builtin_cpu_init();
+  int has_avx512 = __builtin_cpu_supports("avx512f");
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  if (want != NULL && strcmp(want, "scalar") == 0)
+    has_avx512 = has_avx2 = 0;
+  if (want != NULL && strcmp(want, "avx2") == 0)
+    has_avx512 = 0;
+  if (has_avx512) {
+    kernel_u32 = (struct kernel){"avx512", 12, 16, kernel_12x16_avx512_u32};
+    kernel_s32 = (struct kernel){"avx512", 12, 16, kernel_12x16_avx512_s32};
+  } else if (has_avx2) {
+    kernel_u32 = (struct kernel){"avx2", 6, 8, kernel_6x8_avx2_u32};
+    kernel_s32 = (struct kernel){"avx2", 6, 8, kernel_6x8_avx2_s32};
+  }
+#else
+  (void)want;
+#endif
+  log("gemm kernel for 32-bit entries: %s", kernel_u32.name);
+}
+
+// C = 0 when the inner dimension is empty
+static void clear(int m, int n, ulong *C, int ldc) {
+  for (int i = 0; i < m; i++)
+    memset(C + (size_t)i * (size_t)ldc, 0, sizeof(ulong) * (size_t)n);
+}
+
+void gemm_blocking(int kc, int mc, int nc) {
+  // whole register tiles of every kernel: MR in {4, 6, 12}, NR in {2, 8, 16}
+  blk.kc = kc > 0 ? kc : GEMM_KC;
+  blk.mc = mc > 0 ? ceildivi(mc, 12) * 12 : GEMM_MC;
+  blk.nc = nc > 0 ? ceildivi(nc, 16) * 16 : GEMM_NC;
+  log("gemm_blocking kc=%d mc=%d nc=%d", blk.kc, blk.mc, blk.nc);
+}
+
+void gemm(int m, int n, int k, const unsigned long *A, int lda,
+          const unsigned long *B, int ldb, unsigned long *C, int ldc) {
+  if (m <= 0 || n <= 0)
+    return;
+  if (k <= 0) {
+    clear(m, n, C, ldc);
+    return;
+  }
+
+  pthread_once(&bufs_once, bufs_init);
+  const struct kernel *kern = choose_kernel(m, n, k, A, lda, B, ldb);
+  int nthread = pool_size(), ncopy = replicate ? pool_nodes() : 1;
+  ulong *bp[ncopy];
+  for (int c = 0; c < ncopy; c++) {
+    reserve(&bpack[c].b, &bpack[c].cap,
+            (size_t)blk.kc * (size_t)ceildivi(n, kern->nr) * (size_t)kern->nr);
+    bp[c] = bpack[c].b;
+  }
+
+  struct gemm_arg arg = {.m = m, .n = n, .k = k, .A = A, .lda = lda,
+                         .B = B, .ldb = ldb, .C = C, .ldc = ldc,
+                         .kern = kern,
+                         .bp = bp,
+                         .ncopy = ncopy,
+                         .num_mb = ceildivi(m, blk.mc),
+                         .num_nb = ceildivi(n, blk.nc)};
+  log("gemm m=%d n=%d k=%d nthread=%d kernel=%s", m, n, k, nthread,
+      kern->name);
+
+  // rows of tiles of each worker: the first one starting at or after the
+  // first row the worker owns
+  int first[nthread + 1];
+  for (int w = 0, mb = 0; w <= nthread; w++) {
+    while (mb < arg.num_mb && pool_owner(mb * blk.mc, m) < w)
+      mb++;
+    first[w] = mb * arg.num_nb;
+  }
+  struct worksteal_deque dq[nthread];
+  arg.dq = dq;
+  arg.ndq = nthread;
+
+  for (int pc = 0; pc < k; pc += blk.kc) {
+    arg.pc = pc;
+    arg.kc = mini(blk.kc, k - pc);
+    worksteal_init(dq, nthread, first);
+    pool_run(pack_b_worker, &arg);
+    pool_run(multiply_worker, &arg);
+  }
+}
+
+void gemm_local(int tid, int m, int n, int k, const unsigned long *A,
+                int lda, const unsigned long *B, int ldb, unsigned long *C,
+                int ldc) {
+  if (m <= 0 || n <= 0)
+    return;
+  if (k <= 0) {
+    clear(m, n, C, ldc);
+    return;
+  }
+
+  pthread_once(&bufs_once, bufs_init);
+  const struct kernel *kern = choose_kernel(m, n, k, A, lda, B, ldb);
+  struct buffers *buf = &bufs[tid];
+  reserve(&buf->b, &buf->b_cap,
+          (size_t)blk.kc * (size_t)ceildivi(n, kern->nr) * (size_t)kern->nr);
+
+  struct worksteal_deque dq;
+  struct gemm_arg arg = {.m = m, .n = n, .k = k, .A = A, .lda = lda,
+                         .B = B, .ldb = ldb, .C = C, .ldc = ldc,
+                         .kern = kern,
+                         .bp = &buf->b,
+                         .ncopy = 1,
+                         .num_mb = ceildivi(m, blk.mc),
+                         .num_nb = ceildivi(n, blk.nc),
+                         .dq = &dq,
+                         .ndq = 1};
+  log("gemm_local tid=%d m=%d n=%d k=%d kernel=%s", tid, m, n, k, kern->name);
+
+  // the same two jobs, run by this thread alone
+  for (int pc = 0; pc < k; pc += blk.kc) {
+    arg.pc = pc;
+    arg.kc = mini(blk.kc, k - pc);
+    worksteal_init(&dq, 1, (int[]){0, arg.num_mb * arg.num_nb});
+    pack_b_worker(&arg, 0, 1);
+    multiply_worker(&arg, tid, 1);
+  }
+}
+
+// vim: sw=2
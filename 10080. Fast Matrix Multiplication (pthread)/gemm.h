@@ -0,0 +1,38 @@
+#ifndef _GEMM_H
+#define _GEMM_H
+
+// Blocked matrix product on the worker pool, in the style of Goto's GEMM:
+// panels of B and blocks of A are packed into contiguous aligned buffers
+// sized for L3/L2/L1, and an MR x NR micro-kernel keeps its tile of C in
+// registers for a whole KC-deep panel.
+//
+// Matrices are row major with leading dimensions (elements per row in
+// memory). All arithmetic is unsigned 64-bit and wraps around, so the result
+// is exact modulo 2^64.
+//
+// When every entry of A and B fits in 32 bits, which is always the case for
+// the generated inputs, or is a small negative number modulo 2^64, a SIMD
+// kernel built on 32 x 32 -> 64-bit lane multiplies is used instead of the
+// generic one (environment variable MATMUL_SIMD=scalar|avx2|avx512 caps the
+// instruction set).
+
+// default cache blocking: KC-deep panels of B, MC x NC tiles of C
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 256
+
+// Set the cache blocking for later calls (0 keeps the default). MC and NC are
+// rounded up to whole register tiles of every kernel.
+void gemm_blocking(int kc, int mc, int nc);
+
+// C = A * B, with A m x k, B k x n and C m x n
+void gemm(int m, int n, int k, const unsigned long *A, int lda,
+          const unsigned long *B, int ldb, unsigned long *C, int ldc);
+
+// same as gemm(), but run by the calling thread alone with the packing
+// buffers of pool worker tid, so it may be called from inside a pool job
+void gemm_local(int tid, int m, int n, int k, const unsigned long *A,
+                int lda, const unsigned long *B, int ldb, unsigned long *C,
+                int ldc);
+
+#endif
@@ -1,49 +1,168 @@
+#define _GNU_SOURCE
+
 #include "matrix.h"
+#include "pool.h"
+#include "signature.h"
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 // #define DEBUG
 #define UINT unsigned long
-#define MAXN 2048
-void rand_gen(UINT c, int N, UINT A[][MAXN]) {
-  UINT x = 2, n = N * N;
+#define HUGE_PAGE (2UL << 20)
+void rand_gen(UINT c, int N, UINT *A, int lda) {
+  UINT x = 2, n = (UINT)N * (UINT)N;
   for (int i = 0; i < N; i++) {
     for (int j = 0; j < N; j++) {
       x = (x * x + c + i + j) % n;
-      A[i][j] = x;
+      A[(size_t)i * (size_t)lda + (size_t)j] = x;
     }
   }
 }
-void print_matrix(int N, UINT A[][MAXN]) {
+void print_matrix(int N, UINT *A, int lda) {
   for (int i = 0; i < N; i++) {
     fprintf(stderr, "[");
     for (int j = 0; j < N; j++)
-      fprintf(stderr, "%6u", A[i][j]);
+      fprintf(stderr, "%6u", A[(size_t)i * (size_t)lda + (size_t)j]);
     fprintf(stderr, " ]\n");
   }
   fprintf(stderr, "\n");
 }
-UINT hash(UINT x) { return (x * 2654435761LU); }
-UINT signature(int N, UINT A[][MAXN]) {
-  UINT h = 0;
-  for (int i = 0; i < N; i++) {
-    for (int j = 0; j < N; j++)
-      h = hash(h + A[i][j]);
+// Rows are padded to whole cache lines, plus one more line when that makes
+// the stride a multiple of 4 KiB, so walking down a column does not keep
+// hitting the same cache sets.
+int leading_dimension(int N) {
+  int ld = (N + 7) / 8 * 8;
+  if (ld % 512 == 0)
+    ld += 8;
+  return ld;
+}
+// Matrices are allocated for the largest N seen so far, aligned to 2 MiB and
+// marked for transparent huge pages, which cuts TLB misses when large
+// matrices are walked with big strides. The workers then first-touch the
+// rows they own, so the pages are spread over the NUMA nodes the way the
+// multiply reads and writes them.
+UINT *alloc_matrix(int N, int ld) {
+  size_t elems = (size_t)N * (size_t)ld;
+  size_t bytes = (elems * sizeof(UINT) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  void *p;
+  if (posix_memalign(&p, HUGE_PAGE, bytes) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  pool_touch(p, N, ld);
+  return p;
+}
+// Cases are pipelined: while case i is multiplied and hashed, two helper
+// threads generate A and B of case i + 1 into the other slot. The helpers
+// are started once and sleep on a condition variable between matrices, so
+// a run of small cases does not pay two thread creations per case.
+struct gen {
+  UINT c, *X;
+  int N, ld;
+};
+struct helper {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // a job was posted or finished
+  struct gen *job;     // matrix being generated, NULL when idle
+  pthread_t thread;
+} helper[2] = {{.lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER},
+               {.lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER}};
+void *helper_thread(void *arg) {
+  struct helper *h = arg;
+  pthread_mutex_lock(&h->lock);
+  for (;;) {
+    while (h->job == NULL)
+      pthread_cond_wait(&h->cond, &h->lock);
+    struct gen *g = h->job;
+    pthread_mutex_unlock(&h->lock);
+    rand_gen(g->c, g->N, g->X, g->ld);
+    pthread_mutex_lock(&h->lock);
+    h->job = NULL;
+    pthread_cond_broadcast(&h->cond);
   }
-  return h;
+  return NULL;
+}
+void helper_post(struct helper *h, struct gen *g) {
+  static int started;
+  if (!started) {
+    for (int i = 0; i < 2; i++)
+      pool_spawn(&helper[i].thread, helper_thread, &helper[i]);
+    started = 1;
+  }
+  pthread_mutex_lock(&h->lock);
+  h->job = g;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->lock);
+}
+void helper_wait(struct helper *h) {
+  pthread_mutex_lock(&h->lock);
+  while (h->job != NULL)
+    pthread_cond_wait(&h->cond, &h->lock);
+  pthread_mutex_unlock(&h->lock);
+}
+struct slot {
+  int N, ld, S1, S2;
+  UINT *A, *B;
+  size_t cap;
+  struct gen gen[2];
+};
+// reads the next case into the slot and starts generating it
+int start_case(struct slot *s) {
+  if (scanf("%d %d %d", &s->N, &s->S1, &s->S2) != 3)
+    return 0;
+  s->ld = leading_dimension(s->N);
+  size_t elems = (size_t)s->N * (size_t)s->ld;
+  if (elems > s->cap) {
+    free(s->A), free(s->B);
+    s->A = alloc_matrix(s->N, s->ld);
+    s->B = alloc_matrix(s->N, s->ld);
+    s->cap = elems;
+  }
+  s->gen[0] = (struct gen){.c = (UINT)s->S1, .X = s->A, .N = s->N, .ld = s->ld};
+  s->gen[1] = (struct gen){.c = (UINT)s->S2, .X = s->B, .N = s->N, .ld = s->ld};
+  for (int i = 0; i < 2; i++)
+    helper_post(&helper[i], &s->gen[i]);
+  return 1;
+}
+// waits until the helpers have generated the case started last
+void finish_case(void) {
+  for (int i = 0; i < 2; i++)
+    helper_wait(&helper[i]);
 }
-static UINT A[MAXN][MAXN], B[MAXN][MAXN], C[MAXN][MAXN];
 int main() {
-  int N, S1, S2;
-  while (scanf("%d %d %d", &N, &S1, &S2) == 3) {
-    rand_gen(S1, N, A);
-    rand_gen(S2, N, B);
-    multiply(N, A, B, C);
+  struct slot slot[2] = {{0}};
+  UINT *C = NULL;
+  size_t cap = 0;
+  int cur = 0, more = start_case(&slot[cur]);
+  while (more) {
+    struct slot *s = &slot[cur];
+    finish_case();
+    more = start_case(&slot[cur ^ 1]);
+    int N = s->N, ld = s->ld;
+    size_t elems = (size_t)N * (size_t)ld;
+    if (elems > cap) {
+      free(C);
+      C = alloc_matrix(N, ld);
+      cap = elems;
+    }
+    multiply(N, s->A, ld, s->B, ld, C, ld);
 #ifdef DEBUG
-    print_matrix(N, A);
-    print_matrix(N, B);
-    print_matrix(N, C);
+    print_matrix(N, s->A, ld);
+    print_matrix(N, s->B, ld);
+    print_matrix(N, C, ld);
 #endif
-    printf("%u\n", signature(N, C));
+    printf("%u\n", signature(N, C, ld));
+    cur ^= 1;
   }
+  for (int i = 0; i < 2; i++)
+    free(slot[i].A), free(slot[i].B);
+  free(C);
   return 0;
 }
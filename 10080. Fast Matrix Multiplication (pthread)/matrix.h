@@ -1,2 +1,4 @@
-void multiply(int N, const unsigned long A[][2048],
-              const unsigned long B[][2048], unsigned long C[][2048]);
+// C = A * B, all N x N and row major; lda, ldb and ldc are the leading
+// dimensions (elements from one row to the next)
+void multiply(int N, const unsigned long *A, int lda, const unsigned long *B,
+              int ldb, unsigned long *C, int ldc);
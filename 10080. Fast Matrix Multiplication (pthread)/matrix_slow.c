@@ -1,13 +1,13 @@
 #include "matrix.h"
 
-void multiply(int N, const unsigned long A[][2048],
-              const unsigned long B[][2048], unsigned long C[][2048]) {
+void multiply(int N, const unsigned long *A, int lda, const unsigned long *B,
+              int ldb, unsigned long *C, int ldc) {
   for (int i = 0; i < N; i++) {
     for (int j = 0; j < N; j++) {
       unsigned long sum = 0; // overflow, let it go.
       for (int k = 0; k < N; k++)
-        sum += A[i][k] * B[k][j];
-      C[i][j] = sum;
+        sum += A[(long)i * lda + k] * B[(long)k * ldb + j];
+      C[(long)i * ldc + j] = sum;
     }
   }
 }
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+#include "gemm.h"
+#include "morton.h"
+#include "pool.h"
+#include "strassen.h"
+#include "tune.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// matrix_tune [N ...]
+//
+// Measures matrix_fast's parameters on this machine for each order N (by
+// default TUNE_ORDERS) and writes the fastest ones to the tuning profile
+// (see tune.h). For every candidate worker count a child process starts its
+// own pool and tunes all orders; the count with the least total time wins.
+//
+// Within a child each order is tuned one parameter at a time, starting from
+// the defaults: gemm's KC, MC and NC with the recursion off, then the
+// Strassen cutoff, then the Morton layout. Every product is checked against
+// the first one.
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define TUNE_ORDERS {256, 512, 1024, 2048}
+
+// each setting is timed at least MIN_RUNS times and for MIN_SECONDS, and the
+// fastest run counts
+#define MIN_RUNS 2
+#define MIN_SECONDS 0.2
+
+typedef unsigned long ulong;
+
+struct result {
+  struct tune_entry e;
+  double seconds;
+};
+
+struct bench {
+  int n, ld;
+  ulong *A, *B, *C, *ref;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static ulong *alloc(size_t elems) {
+  void *p;
+  if (posix_memalign(&p, 64, sizeof(ulong) * elems) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  return p;
+}
+
+// entries below n^2 like the generated inputs, so the same kernels are chosen
+static void fill(int n, ulong *X, int ldx, ulong seed) {
+  ulong x = seed, mod = (ulong)n * (ulong)n;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++) {
+      x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+      X[(size_t)i * (size_t)ldx + (size_t)j] = x % mod;
+    }
+}
+
+static void run(const struct tune_entry *e, struct bench *b) {
+  tune_apply(e);
+  if (!e->morton) {
+    strassen(b->n, b->A, b->ld, b->B, b->ld, b->C, b->ld);
+    return;
+  }
+  static struct morton a, m, c;
+  morton_resize(&a, b->n);
+  morton_resize(&m, b->n);
+  morton_resize(&c, b->n);
+  morton_from_rows(&a, b->A, b->ld);
+  morton_from_rows(&m, b->B, b->ld);
+  morton_multiply(&a, &m, &c);
+  morton_to_rows(&c, b->C, b->ld);
+}
+
+static double measure(const struct tune_entry *e, struct bench *b) {
+  double best = 0, total = 0;
+  for (int r = 0; r < MIN_RUNS || total < MIN_SECONDS; r++) {
+    double t0 = now();
+    run(e, b);
+    double t = now() - t0;
+    total += t;
+    if (r == 0 || t < best)
+      best = t;
+  }
+  size_t elems = (size_t)b->n * (size_t)b->ld;
+  if (b->ref == NULL) {
+    b->ref = alloc(elems);
+    memcpy(b->ref, b->C, sizeof(ulong) * elems);
+  } else {
+    for (int i = 0; i < b->n; i++)
+      if (memcmp(b->C + (size_t)i * (size_t)b->ld,
+                 b->ref + (size_t)i * (size_t)b->ld,
+                 sizeof(ulong) * (size_t)b->n) != 0) {
+        fprintf(stderr,
+                "matrix_tune: wrong product for n=%d %s cutoff=%d kc=%d "
+                "mc=%d nc=%d\n",
+                b->n, e->morton ? "morton" : "rows", e->cutoff, e->kc, e->mc,
+                e->nc);
+        exit(1);
+      }
+  }
+  log("n=%d %s cutoff=%d kc=%d mc=%d nc=%d: %.4fs", b->n,
+      e->morton ? "morton" : "rows", e->cutoff, e->kc, e->mc, e->nc, best);
+  return best;
+}
+
+// measure e and keep it if it beats the best so far
+static void try(struct result *best, const struct tune_entry *e,
+                struct bench *b) {
+  if (memcmp(e, &best->e, sizeof(*e)) == 0)
+    return;
+  double t = measure(e, b);
+  if (t < best->seconds)
+    *best = (struct result){*e, t};
+}
+
+static struct result tune_order(int n) {
+  static const int kcs[] = {128, 256, 384, 512};
+  static const int mcs[] = {48, 96, 144, 192};
+  static const int ncs[] = {128, 256, 512};
+  static const int cutoffs[] = {128, 256, 512, 1024};
+
+  struct bench b = {.n = n, .ld = (n + 7) / 8 * 8};
+  size_t elems = (size_t)n * (size_t)b.ld;
+  b.A = alloc(elems), b.B = alloc(elems), b.C = alloc(elems);
+  fill(n, b.A, b.ld, 0x9e3779b97f4a7c15UL);
+  fill(n, b.B, b.ld, 0xbf58476d1ce4e5b9UL);
+
+  // the recursion off while gemm's blocking is tuned
+  struct result best = {.e = {.n = n, .morton = 0, .cutoff = 0,
+                              .kc = GEMM_KC, .mc = GEMM_MC, .nc = GEMM_NC}};
+  best.seconds = measure(&best.e, &b);
+  struct tune_entry e;
+  for (size_t i = 0; i < sizeof(kcs) / sizeof(*kcs); i++)
+    e = best.e, e.kc = kcs[i], try(&best, &e, &b);
+  for (size_t i = 0; i < sizeof(mcs) / sizeof(*mcs); i++)
+    e = best.e, e.mc = mcs[i], try(&best, &e, &b);
+  for (size_t i = 0; i < sizeof(ncs) / sizeof(*ncs); i++)
+    e = best.e, e.nc = ncs[i], try(&best, &e, &b);
+  for (size_t i = 0; i < sizeof(cutoffs) / sizeof(*cutoffs); i++)
+    if (cutoffs[i] < n)
+      e = best.e, e.cutoff = cutoffs[i], try(&best, &e, &b);
+  e = best.e, e.morton = 1, try(&best, &e, &b);
+
+  free(b.A), free(b.B), free(b.C), free(b.ref);
+  return best;
+}
+
+// child process: start a pool of nthread workers, tune every order and
+// write the results to fd
+static void tune_child(int nthread, int norder, const int *order, int fd) {
+  pool_set_size(nthread);
+  for (int i = 0; i < norder; i++) {
+    struct result r = tune_order(order[i]);
+    fprintf(stderr, "threads=%d n=%d: %s cutoff=%d kc=%d mc=%d nc=%d %.4fs\n",
+            nthread, r.e.n, r.e.morton ? "morton" : "rows", r.e.cutoff,
+            r.e.kc, r.e.mc, r.e.nc, r.seconds);
+    if (write(fd, &r, sizeof(r)) != (ssize_t)sizeof(r))
+      exit(1);
+  }
+}
+
+// runs tune_child() in a child process so that each worker count gets a
+// fresh pool; returns the total time, or a negative value on failure
+static double tune_threads(int nthread, int norder, const int *order,
+                           struct result *out) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    tune_child(nthread, norder, order, fds[1]);
+    _exit(0);
+  }
+  close(fds[1]);
+  double total = 0;
+  int got = 0;
+  while (got < norder &&
+         read(fds[0], &out[got], sizeof(*out)) == (ssize_t)sizeof(*out))
+    total += out[got++].seconds;
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (got < norder || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return -1;
+  return total;
+}
+
+int main(int argc, char **argv) {
+  const int def[] = TUNE_ORDERS;
+  int norder = argc > 1 ? argc - 1 : (int)(sizeof(def) / sizeof(*def));
+  int order[norder];
+  for (int i = 0; i < norder; i++)
+    if ((order[i] = argc > 1 ? atoi(argv[i + 1]) : def[i]) <= 0) {
+      fprintf(stderr, "usage: %s [N ...]\n", argv[0]);
+      return 1;
+    }
+
+  // powers of two below the CPU count and the CPU count itself, or only
+  // MATMUL_THREADS if that is set
+  cpu_set_t set;
+  int ncpu = 1;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    ncpu = CPU_COUNT(&set);
+  int ncand = 0, cand[32];
+  const char *env = getenv("MATMUL_THREADS");
+  if (env != NULL && atoi(env) > 0) {
+    cand[ncand++] = atoi(env);
+  } else {
+    for (int t = 1; t < ncpu && ncand < 31; t *= 2)
+      cand[ncand++] = t;
+    cand[ncand++] = ncpu;
+  }
+
+  struct result best[norder], cur[norder];
+  double best_total = -1;
+  int best_threads = 0;
+  for (int c = 0; c < ncand; c++) {
+    double total = tune_threads(cand[c], norder, order, cur);
+    if (total < 0) {
+      fprintf(stderr, "matrix_tune: tuning with %d threads failed\n", cand[c]);
+      return 1;
+    }
+    if (best_total < 0 || total < best_total) {
+      best_total = total, best_threads = cand[c];
+      memcpy(best, cur, sizeof(cur));
+    }
+  }
+
+  struct tune_entry entry[norder];
+  for (int i = 0; i < norder; i++)
+    entry[i] = best[i].e;
+  struct tune_profile profile = {best_threads, norder, entry};
+  const char *path = tune_path();
+  if (tune_save(path, &profile) != 0)
+    return 1;
+  fprintf(stderr, "matrix_tune: %d threads, profile written to %s\n",
+          best_threads, path);
+  return 0;
+}
+
+// vim: sw=2
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include "morton.h"
+#include "gemm.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define mini(x, y)                                                             \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    _x < _y ? _x : _y;                                                         \
+  })
+
+#define ceildivi(x, y)                                                         \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    (_x + _y - 1) / _y;                                                        \
+  })
+
+#define HUGE_PAGE (2UL << 20)
+
+// at least this many top-level tasks per worker, for balance
+#define TASKS_PER_WORKER 4
+
+typedef unsigned long ulong;
+
+// position of leaf (bi, bj) in Z order: the bits of bi and bj interleaved,
+// row bits above column bits
+static size_t zindex(int bi, int bj) {
+  size_t z = 0;
+  for (int b = 0; bi >> b || bj >> b; b++)
+    z |= (size_t)((bi >> b) & 1) << (2 * b + 1) |
+         (size_t)((bj >> b) & 1) << (2 * b);
+  return z;
+}
+
+// the inverse of zindex()
+static void zsplit(size_t z, int *bi, int *bj) {
+  *bi = *bj = 0;
+  for (int b = 0; z >> (2 * b); b++) {
+    *bi |= (int)((z >> (2 * b + 1)) & 1) << b;
+    *bj |= (int)((z >> (2 * b)) & 1) << b;
+  }
+}
+
+static size_t leaf_size(const struct morton *M) {
+  return (size_t)M->leaf * (size_t)M->leaf;
+}
+
+void morton_resize(struct morton *M, int n) {
+  // the fewest levels that bring a leaf down to MORTON_LEAF, then the
+  // smallest leaf, in whole cache lines, that covers n
+  int depth = 0;
+  while (ceildivi(n, 1 << depth) > MORTON_LEAF)
+    depth++;
+  M->n = n;
+  M->depth = depth;
+  M->leaf = ceildivi(ceildivi(n, 1 << depth), 8) * 8;
+
+  size_t side = (size_t)M->leaf << depth, elems = side * side;
+  if (elems <= M->cap)
+    return;
+  free(M->data);
+  size_t bytes = (elems * sizeof(ulong) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  void *p;
+  if (posix_memalign(&p, HUGE_PAGE, bytes) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  M->data = p;
+  M->cap = elems;
+  log("morton n=%d leaf=%d depth=%d", n, M->leaf, depth);
+}
+
+void morton_free(struct morton *M) {
+  free(M->data);
+  *M = (struct morton){0};
+}
+
+struct convert_arg {
+  struct morton *M;
+  ulong *X;
+  int ldx;
+  int to_rows;
+};
+
+// pool job: convert rows of leaves tid, tid + nthread, ...
+static void convert_worker(void *arg_, int tid, int nthread) {
+  const struct convert_arg *arg = arg_;
+  const struct morton *M = arg->M;
+  int n = M->n, leaf = M->leaf, nleaf = 1 << M->depth;
+  for (int bi = tid; bi < nleaf; bi += nthread) {
+    for (int bj = 0; bj < nleaf; bj++) {
+      ulong *Z = M->data + zindex(bi, bj) * leaf_size(M);
+      int i0 = bi * leaf, j0 = bj * leaf;
+      int rows = mini(leaf, n - i0), cols = mini(leaf, n - j0);
+      for (int r = 0; r < leaf; r++) {
+        ulong *z = Z + (size_t)r * (size_t)leaf;
+        ulong *x = arg->X + (size_t)(i0 + r) * (size_t)arg->ldx + (size_t)j0;
+        if (arg->to_rows) {
+          if (r < rows && cols > 0)
+            memcpy(x, z, sizeof(ulong) * (size_t)cols);
+          continue;
+        }
+        // the padding past row or column n - 1 is zero
+        int copied = r < rows && cols > 0 ? cols : 0;
+        memcpy(z, x, sizeof(ulong) * (size_t)copied);
+        memset(z + copied, 0, sizeof(ulong) * (size_t)(leaf - copied));
+      }
+    }
+  }
+}
+
+void morton_from_rows(struct morton *M, const unsigned long *X, int ldx) {
+  struct convert_arg arg = {M, (ulong *)X, ldx, 0};
+  pool_run(convert_worker, &arg);
+}
+
+void morton_to_rows(const struct morton *M, unsigned long *X, int ldx) {
+  struct convert_arg arg = {(struct morton *)M, X, ldx, 1};
+  pool_run(convert_worker, &arg);
+}
+
+struct multiply_arg {
+  const struct morton *A, *B;
+  struct morton *C;
+  int level;   // tasks are the blocks of C 2^level leaves on a side
+  int ntask;   // 4^level
+  ulong *tmp;  // one leaf per worker
+  int next;    // next task, shared by the workers
+};
+
+// C = A * B (acc == 0) or C += A * B (acc != 0) on blocks 2^e leaves on a
+// side. The eight half-size products run in an order where each one shares
+// an operand quadrant with the one before it.
+static void multiply_rec(const struct multiply_arg *arg, int tid, int acc,
+                         int e, const ulong *A, const ulong *B, ulong *C) {
+  int leaf = arg->C->leaf;
+  if (e == 0) {
+    if (!acc) {
+      gemm_local(tid, leaf, leaf, leaf, A, leaf, B, leaf, C, leaf);
+      return;
+    }
+    size_t size = leaf_size(arg->C);
+    ulong *T = arg->tmp + (size_t)tid * size;
+    gemm_local(tid, leaf, leaf, leaf, A, leaf, B, leaf, T, leaf);
+    for (size_t t = 0; t < size; t++)
+      C[t] += T[t];
+    return;
+  }
+  size_t q = leaf_size(arg->C) << (2 * (e - 1));
+  const ulong *A0 = A, *A1 = A + q, *A2 = A + 2 * q, *A3 = A + 3 * q;
+  const ulong *B0 = B, *B1 = B + q, *B2 = B + 2 * q, *B3 = B + 3 * q;
+  ulong *C0 = C, *C1 = C + q, *C2 = C + 2 * q, *C3 = C + 3 * q;
+  multiply_rec(arg, tid, acc, e - 1, A0, B0, C0);
+  multiply_rec(arg, tid, acc, e - 1, A0, B1, C1);
+  multiply_rec(arg, tid, acc, e - 1, A2, B1, C3);
+  multiply_rec(arg, tid, acc, e - 1, A2, B0, C2);
+  multiply_rec(arg, tid, 1, e - 1, A3, B2, C2);
+  multiply_rec(arg, tid, 1, e - 1, A3, B3, C3);
+  multiply_rec(arg, tid, 1, e - 1, A1, B3, C1);
+  multiply_rec(arg, tid, 1, e - 1, A1, B2, C0);
+}
+
+// pool job: take blocks of C until none are left; block (I, J) is the sum
+// over K of A(I, K) * B(K, J)
+static void multiply_worker(void *arg_, int tid, int nthread) {
+  struct multiply_arg *arg = arg_;
+  int e = arg->C->depth - arg->level, nblock = 1 << arg->level;
+  size_t block = leaf_size(arg->C) << (2 * e);
+  for (;;) {
+    int task = __atomic_fetch_add(&arg->next, 1, __ATOMIC_RELAXED);
+    if (task >= arg->ntask)
+      break;
+    int I, J;
+    zsplit((size_t)task, &I, &J);
+    ulong *C = arg->C->data + (size_t)task * block;
+    for (int K = 0; K < nblock; K++)
+      multiply_rec(arg, tid, K > 0, e, arg->A->data + zindex(I, K) * block,
+                   arg->B->data + zindex(K, J) * block, C);
+  }
+  (void)nthread;
+}
+
+void morton_multiply(const struct morton *A, const struct morton *B,
+                     struct morton *C) {
+  static ulong *tmp;
+  static size_t tmp_cap;
+
+  int nthread = pool_size();
+  size_t need = (size_t)nthread * leaf_size(C);
+  if (need > tmp_cap) {
+    free(tmp);
+    if (posix_memalign((void **)&tmp, 64, sizeof(ulong) * need) != 0) {
+      perror("posix_memalign");
+      exit(1);
+    }
+    tmp_cap = need;
+  }
+
+  // the shallowest level with enough blocks of C to go round
+  int level = 0;
+  while (level < C->depth && (1 << (2 * level)) < TASKS_PER_WORKER * nthread)
+    level++;
+  struct multiply_arg arg = {.A = A, .B = B, .C = C,
+                             .level = level,
+                             .ntask = 1 << (2 * level),
+                             .tmp = tmp};
+  log("morton_multiply n=%d leaf=%d depth=%d level=%d", C->n, C->leaf,
+      C->depth, level);
+  pool_run(multiply_worker, &arg);
+}
+
+// vim: sw=2
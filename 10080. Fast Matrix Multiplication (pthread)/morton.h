@@ -0,0 +1,43 @@
+#ifndef _MORTON_H
+#define _MORTON_H
+
+#include <stddef.h>
+
+// Matrices in recursive Z order (Morton order). The matrix is zero-padded to
+// order leaf * 2^depth and cut into 2^depth x 2^depth leaf blocks; the leaves
+// are stored one after the other in Z order, each one row major with leading
+// dimension leaf. Every quadrant, at every level of the recursion, is then a
+// contiguous run of memory.
+//
+// The multiply recurses on quadrants down to single leaves, so the working
+// set shrinks by 4 at every level and some level fits each cache, whatever
+// its size, without a blocking parameter tuned to the machine. Leaves are at
+// most MORTON_LEAF on a side and are multiplied by gemm_local().
+
+#define MORTON_LEAF 128
+
+struct morton {
+  int n;     // order of the matrix
+  int leaf;  // order of a leaf block
+  int depth; // 2^depth leaves on a side
+  unsigned long *data;
+  size_t cap; // elements allocated at data
+};
+
+// Lay out M for an n x n matrix, growing its storage if needed. Matrices of
+// the same order get the same leaf and depth.
+void morton_resize(struct morton *M, int n);
+
+void morton_free(struct morton *M);
+
+// row major X (leading dimension ldx) -> M, on the worker pool
+void morton_from_rows(struct morton *M, const unsigned long *X, int ldx);
+
+// M -> row major X (leading dimension ldx), on the worker pool
+void morton_to_rows(const struct morton *M, unsigned long *X, int ldx);
+
+// C = A * B on the worker pool; all three laid out for the same order
+void morton_multiply(const struct morton *A, const struct morton *B,
+                     struct morton *C);
+
+#endif
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include "topo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+// polls of the job counter before falling back to the condition variable,
+// on the order of ten microseconds
+#define SPIN_ITERS 4000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+static struct {
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a new job was posted
+  pthread_cond_t done; // the last worker finished the job
+
+  int nthread;
+  int requested; // pool_set_size(), 0 if not called
+  pthread_t *threads;
+  int *cpu;       // CPU worker tid is pinned to, -1 if not pinned
+  int *node;      // node of worker tid, numbered 0 .. nnode - 1
+  int *node_rank; // rank of worker tid among the workers on its node
+  int *node_size;
+  int nnode;
+  cpu_set_t allowed; // CPUs of the process before anything was pinned
+
+  unsigned long job; // incremented for every job
+  int pending;       // workers (other than the caller) still running the job
+  pool_fn fn;
+  void *arg;
+} pool = {.once = PTHREAD_ONCE_INIT,
+          .lock = PTHREAD_MUTEX_INITIALIZER,
+          .wake = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+static void pin(int tid) {
+  if (pool.cpu[tid] >= 0)
+    topo_pin(pool.cpu[tid]);
+}
+
+static void *pool_worker(void *arg_) {
+  int tid = (int)(long)arg_;
+  unsigned long seen = 0;
+  pin(tid);
+  for (;;) {
+    for (int i = 0; i < SPIN_ITERS &&
+                    __atomic_load_n(&pool.job, __ATOMIC_ACQUIRE) == seen;
+         i++)
+      cpu_relax();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.job == seen)
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    seen = pool.job;
+    pool_fn fn = pool.fn;
+    void *arg = pool.arg;
+    pthread_mutex_unlock(&pool.lock);
+
+    log("pool_worker tid=%d job=%lu", tid, seen);
+    fn(arg, tid, pool.nthread);
+
+    if (__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_lock(&pool.lock);
+      pthread_cond_signal(&pool.done);
+      pthread_mutex_unlock(&pool.lock);
+    }
+  }
+  return NULL;
+}
+
+// Worker tid goes to the tid-th CPU of topo_affinity() (wrapping around if
+// there are more workers than CPUs), so consecutive workers fill a node
+// before moving on to the next one.
+static void place(int ncpu, const struct topo_cpu *cpus, int pinning) {
+  int n = pool.nthread;
+  const char *env = getenv("MATMUL_PIN");
+  pinning = pinning && ncpu > 0 && (env == NULL || strcmp(env, "0") != 0);
+
+  pool.cpu = malloc(sizeof(int) * (size_t)n);
+  pool.node = malloc(sizeof(int) * (size_t)n);
+  pool.node_rank = malloc(sizeof(int) * (size_t)n);
+  pool.node_size = calloc((size_t)n, sizeof(int));
+  int raw[n]; // kernel node number of each compact node number
+  pool.nnode = 0;
+  for (int tid = 0; tid < n; tid++) {
+    pool.cpu[tid] = pinning ? cpus[tid % ncpu].cpu : -1;
+    // threads the scheduler may move around are all on one node
+    int node = pinning ? cpus[tid % ncpu].node : 0, d = 0;
+    while (d < pool.nnode && raw[d] != node)
+      d++;
+    if (d == pool.nnode)
+      raw[pool.nnode++] = node;
+    pool.node[tid] = d;
+    pool.node_rank[tid] = pool.node_size[d]++;
+    log("place tid=%d cpu=%d node=%d", tid, pool.cpu[tid], d);
+  }
+}
+
+// fork(): the child gets only the forking thread, so it forgets the workers
+// and starts a pool of its own on first use, unpinned until then
+static void fork_prepare(void) { pthread_mutex_lock(&pool.lock); }
+static void fork_parent(void) { pthread_mutex_unlock(&pool.lock); }
+static void fork_child(void) {
+  pthread_mutex_unlock(&pool.lock);
+  sched_setaffinity(0, sizeof(pool.allowed), &pool.allowed);
+  pthread_cond_init(&pool.wake, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pool.once = (pthread_once_t)PTHREAD_ONCE_INIT;
+  pool.job = 0;
+  pool.pending = 0;
+}
+
+static void register_atfork(void) {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+static void pool_init(void) {
+  struct topo_cpu *cpus;
+  int pinning, ncpu = topo_affinity(&cpus, &pinning);
+  const char *env = getenv("MATMUL_THREADS");
+  if (env != NULL)
+    pool.nthread = atoi(env);
+  else if (pool.requested > 0)
+    pool.nthread = pool.requested;
+  else
+    pool.nthread = ncpu > 0 ? ncpu : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool.nthread < 1)
+    pool.nthread = 1;
+  log("pool_init nthread=%d", pool.nthread);
+
+  place(ncpu, cpus, pinning);
+  free(cpus);
+  sched_getaffinity(0, sizeof(pool.allowed), &pool.allowed);
+  pin(0);
+
+  // once per process tree: the registration is inherited by the child
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  pthread_once(&atfork_once, register_atfork);
+
+  pool.threads = malloc(sizeof(pthread_t) * (size_t)pool.nthread);
+  for (int i = 1; i < pool.nthread; i++)
+    pthread_create(&pool.threads[i], NULL, pool_worker, (void *)(long)i);
+}
+
+void pool_set_size(int n) { pool.requested = n; }
+
+int pool_size(void) {
+  pthread_once(&pool.once, pool_init);
+  return pool.nthread;
+}
+
+int pool_nodes(void) {
+  pthread_once(&pool.once, pool_init);
+  return pool.nnode;
+}
+
+int pool_node(int tid) { return pool.node[tid]; }
+int pool_node_rank(int tid) { return pool.node_rank[tid]; }
+int pool_node_size(int node) { return pool.node_size[node]; }
+
+int pool_row(int tid, int n) {
+  return (int)((long)n * tid / pool_size());
+}
+
+int pool_owner(int i, int n) {
+  return (int)(((long)(i + 1) * pool_size() - 1) / n);
+}
+
+void pool_spawn(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  pthread_once(&pool.once, pool_init);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setaffinity_np(&attr, sizeof(pool.allowed), &pool.allowed);
+  pthread_create(thread, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+}
+
+struct touch_arg {
+  unsigned long *X;
+  int n, ld;
+};
+
+static void touch_worker(void *arg_, int tid, int nthread) {
+  const struct touch_arg *arg = arg_;
+  int r0 = pool_row(tid, arg->n), r1 = pool_row(tid + 1, arg->n);
+  (void)nthread;
+  memset(arg->X + (size_t)r0 * (size_t)arg->ld, 0,
+         sizeof(unsigned long) * (size_t)(r1 - r0) * (size_t)arg->ld);
+}
+
+void pool_touch(unsigned long *X, int n, int ld) {
+  struct touch_arg arg = {X, n, ld};
+  pool_run(touch_worker, &arg);
+}
+
+void pool_run(pool_fn fn, void *arg) {
+  int nthread = pool_size();
+  if (nthread == 1) {
+    fn(arg, 0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.pending = nthread - 1;
+  __atomic_store_n(&pool.job, pool.job + 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  fn(arg, 0, nthread);
+
+  for (int i = 0;
+       i < SPIN_ITERS && __atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE) != 0;
+       i++)
+    cpu_relax();
+  pthread_mutex_lock(&pool.lock);
+  while (__atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE) != 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// vim: sw=2
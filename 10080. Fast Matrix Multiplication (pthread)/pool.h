@@ -0,0 +1,51 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+
+// Persistent worker pool, started on first use and kept for the lifetime of
+// the process. Between jobs the workers spin briefly and then sleep on a
+// condition variable, so a stream of small multiplications pays a wake-up
+// instead of a pthread_create/pthread_join per thread per call.
+
+// A child created with fork() starts a pool of its own on first use, sized and
+// placed for the CPUs it may run on at that point.
+
+// fn(arg, tid, nthread) is run once on every worker, tid = 0 .. nthread - 1
+typedef void (*pool_fn)(void *arg, int tid, int nthread);
+
+// number of workers: environment variable MATMUL_THREADS if set, otherwise
+// the number of CPUs topo_affinity() picks (one per core by default)
+int pool_size(void);
+
+// Ask for n workers instead of one per CPU. Only has an effect before the
+// pool starts and when MATMUL_THREADS is not set.
+void pool_set_size(int n);
+
+// run fn on all workers and wait for them; the caller is worker 0
+void pool_run(pool_fn fn, void *arg);
+
+// Workers, the caller included, are pinned to the CPUs of topo_affinity() in
+// order (node by node, one thread per core first) unless TOPO_AFFINITY=none or
+// MATMUL_PIN=0. Unpinned workers all count as node 0.
+int pool_nodes(void);           // nodes the workers are on
+int pool_node(int tid);         // node of worker tid, 0 .. pool_nodes() - 1
+int pool_node_rank(int tid);    // index of worker tid among those on its node
+int pool_node_size(int node);   // workers on the node
+
+// Rows 0 .. n - 1 of a matrix are owned in contiguous runs: worker tid owns
+// rows pool_row(tid, n) .. pool_row(tid + 1, n) - 1, and row i belongs to
+// worker pool_owner(i, n). Work on a row should preferably run on its owner.
+int pool_row(int tid, int n);
+int pool_owner(int i, int n);
+
+// Start a helper thread outside the pool. The caller may be pinned to the CPU
+// of worker 0; the helper may run on any CPU the process started with.
+void pool_spawn(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+// Zero the n rows of X (leading dimension ld), each worker the rows it owns,
+// so that with first-touch placement every page lands on the node of its
+// owner. Meant for freshly allocated matrices.
+void pool_touch(unsigned long *X, int n, int ld);
+
+#endif
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+
+#include "shard.h"
+#include "gemm.h"
+#include "pool.h"
+#include "topo.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+// the header takes the first page of the segment, the matrices the rest
+#define HEADER_SIZE 4096
+
+// how often the caller checks that the workers are alive while it waits
+#define POLL_MS 50
+
+typedef unsigned long ulong;
+
+struct header {
+  pthread_mutex_t lock; // robust: a worker may die holding it
+  pthread_cond_t start; // a new product was posted
+  pthread_cond_t done;  // a worker finished its rows
+  ulong seq;            // incremented for every product
+  int quit;
+  int n, ld;                  // A, B and C in the segment, one after the other
+  size_t cap;                 // elements in the data part of the segment
+  int row[SHARD_MAX + 1];     // worker p computes rows row[p] .. row[p + 1] - 1
+  ulong finished[SHARD_MAX];  // seq of the last product worker p finished
+};
+
+typedef char header_fits[sizeof(struct header) <= HEADER_SIZE ? 1 : -1];
+
+static struct {
+  pthread_once_t once;
+  int nproc;
+  int fd;
+  struct header *h;
+  ulong *data; // data part as mapped by this process
+  size_t cap;  // elements mapped at data
+  pid_t pid[SHARD_MAX];
+  int alive[SHARD_MAX];
+} shard = {.once = PTHREAD_ONCE_INIT, .nproc = -1};
+
+int shard_procs(void) {
+  if (shard.nproc < 0) {
+    const char *env = getenv("MATMUL_PROCS");
+    int p = env != NULL ? atoi(env) : 0;
+    shard.nproc = p < 2 ? 0 : p > SHARD_MAX ? SHARD_MAX : p;
+  }
+  return shard.nproc;
+}
+
+static void lock(struct header *h) {
+  if (pthread_mutex_lock(&h->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&h->lock);
+}
+
+static int wait_on(pthread_cond_t *cond, struct header *h,
+                   const struct timespec *deadline) {
+  int err = deadline != NULL
+                ? pthread_cond_timedwait(cond, &h->lock, deadline)
+                : pthread_cond_wait(cond, &h->lock);
+  if (err == EOWNERDEAD)
+    pthread_mutex_consistent(&h->lock);
+  return err;
+}
+
+// (re)maps the data part of the segment for cap elements
+static void map_data(size_t cap) {
+  if (shard.data != NULL)
+    munmap(shard.data, sizeof(ulong) * shard.cap);
+  shard.data = mmap(NULL, sizeof(ulong) * cap, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, shard.fd, HEADER_SIZE);
+  if (shard.data == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  shard.cap = cap;
+}
+
+// rows row[p] .. row[p + 1] - 1 of the posted product
+static void multiply_rows(int p) {
+  struct header *h = shard.h;
+  int n = h->n, ld = h->ld, r0 = h->row[p], r1 = h->row[p + 1];
+  const ulong *A = shard.data, *B = A + (size_t)n * (size_t)ld;
+  ulong *C = shard.data + 2 * (size_t)n * (size_t)ld;
+  log("shard %d rows %d .. %d", p, r0, r1);
+  gemm(r1 - r0, n, n, A + (size_t)r0 * (size_t)ld, ld, B, ld,
+       C + (size_t)r0 * (size_t)ld, ld);
+}
+
+// worker process p: never returns
+static void worker(int p, pid_t parent) {
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent)
+    _exit(0);
+
+  // share p of the CPUs of topo_affinity(), and a pool that fills it
+  struct topo_cpu *cpus;
+  int pinning, ncpu = topo_affinity(&cpus, &pinning);
+  if (ncpu > 0) {
+    int c0 = ncpu * p / shard.nproc, c1 = ncpu * (p + 1) / shard.nproc;
+    if (c1 == c0)
+      c0 = p % ncpu, c1 = c0 + 1;
+    if (pinning) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int c = c0; c < c1; c++)
+        CPU_SET((size_t)cpus[c].cpu, &set);
+      sched_setaffinity(0, sizeof(set), &set);
+    }
+    pool_set_size(c1 - c0);
+  }
+  free(cpus);
+
+  // products are numbered from 1; the first may be posted before we get here
+  struct header *h = shard.h;
+  ulong seen = 0;
+  lock(h);
+  for (;;) {
+    while (h->seq == seen && !h->quit)
+      wait_on(&h->start, h, NULL);
+    if (h->quit)
+      break;
+    seen = h->seq;
+    size_t cap = h->cap;
+    pthread_mutex_unlock(&h->lock);
+
+    if (cap != shard.cap)
+      map_data(cap);
+    multiply_rows(p);
+
+    lock(h);
+    h->finished[p] = seen;
+    pthread_cond_signal(&h->done);
+  }
+  pthread_mutex_unlock(&h->lock);
+  _exit(0);
+}
+
+static void shard_stop(void) {
+  struct header *h = shard.h;
+  lock(h);
+  h->quit = 1;
+  pthread_cond_broadcast(&h->start);
+  pthread_mutex_unlock(&h->lock);
+  for (int p = 0; p < shard.nproc; p++)
+    if (shard.alive[p])
+      waitpid(shard.pid[p], NULL, 0);
+}
+
+static void shard_start(void) {
+  // the name is only needed until the segment is mapped; the workers
+  // inherit the descriptor and the mapping
+  char name[64];
+  snprintf(name, sizeof(name), "/matmul-shard-%d", (int)getpid());
+  shard.fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (shard.fd < 0) {
+    perror("shm_open");
+    exit(1);
+  }
+  shm_unlink(name);
+  if (ftruncate(shard.fd, HEADER_SIZE) != 0) {
+    perror("ftruncate");
+    exit(1);
+  }
+  shard.h = mmap(NULL, HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 shard.fd, 0);
+  if (shard.h == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  struct header *h = shard.h;
+  pthread_mutexattr_t ma;
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&h->lock, &ma);
+  pthread_mutexattr_destroy(&ma);
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&h->start, &ca);
+  pthread_cond_init(&h->done, &ca);
+  pthread_condattr_destroy(&ca);
+
+  pid_t parent = getpid();
+  fflush(NULL);
+  for (int p = 0; p < shard.nproc; p++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid == 0)
+      worker(p, parent);
+    shard.pid[p] = pid;
+    shard.alive[p] = 1;
+    log("shard %d pid %d", p, (int)pid);
+  }
+  atexit(shard_stop);
+}
+
+// Called with the lock held while waiting for product seq. Reaps the workers
+// that died and computes the rows of those that had not finished.
+static void reap(ulong seq) {
+  struct header *h = shard.h;
+  for (int p = 0; p < shard.nproc; p++) {
+    int status;
+    if (!shard.alive[p] || waitpid(shard.pid[p], &status, WNOHANG) == 0)
+      continue;
+    shard.alive[p] = 0;
+    fprintf(stderr, "shard %d (pid %d) %s %d, its rows are computed by the "
+                    "caller from now on\n",
+            p, (int)shard.pid[p],
+            WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+    if (h->finished[p] != seq) {
+      pthread_mutex_unlock(&h->lock);
+      multiply_rows(p);
+      lock(h);
+    }
+  }
+}
+
+void shard_multiply(int n, const unsigned long *A, int lda,
+                    const unsigned long *B, int ldb, unsigned long *C,
+                    int ldc) {
+  if (n <= 0)
+    return;
+  shard_procs();
+  pthread_once(&shard.once, shard_start);
+  struct header *h = shard.h;
+
+  int live = 0;
+  for (int p = 0; p < shard.nproc; p++)
+    live += shard.alive[p];
+  if (live == 0) {
+    gemm(n, n, n, A, lda, B, ldb, C, ldc);
+    return;
+  }
+
+  int ld = ldc;
+  size_t size = (size_t)n * (size_t)ld, need = 3 * size;
+  if (need > shard.cap) {
+    off_t bytes = (off_t)(HEADER_SIZE + sizeof(ulong) * need);
+    if (ftruncate(shard.fd, bytes) != 0) {
+      perror("ftruncate");
+      exit(1);
+    }
+    map_data(need);
+  }
+  for (int i = 0; i < n; i++) {
+    memcpy(shard.data + (size_t)i * (size_t)ld, A + (size_t)i * (size_t)lda,
+           sizeof(ulong) * (size_t)n);
+    memcpy(shard.data + size + (size_t)i * (size_t)ld,
+           B + (size_t)i * (size_t)ldb, sizeof(ulong) * (size_t)n);
+  }
+
+  // post the product: rows split evenly over the live workers
+  lock(h);
+  h->n = n, h->ld = ld, h->cap = shard.cap;
+  for (int p = 0, k = 0; p < shard.nproc; p++) {
+    h->row[p] = n * k / live;
+    k += shard.alive[p];
+  }
+  h->row[shard.nproc] = n;
+  ulong seq = ++h->seq;
+  pthread_cond_broadcast(&h->start);
+
+  // and wait for every live worker to finish it
+  for (;;) {
+    int waiting = 0;
+    for (int p = 0; p < shard.nproc; p++)
+      waiting += shard.alive[p] && h->finished[p] != seq;
+    if (waiting == 0)
+      break;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+      deadline.tv_sec++, deadline.tv_nsec -= 1000000000L;
+    if (wait_on(&h->done, h, &deadline) == ETIMEDOUT)
+      reap(seq);
+  }
+  pthread_mutex_unlock(&h->lock);
+
+  for (int i = 0; i < n; i++)
+    memcpy(C + (size_t)i * (size_t)ldc,
+           shard.data + 2 * size + (size_t)i * (size_t)ld,
+           sizeof(ulong) * (size_t)n);
+}
+
+// vim: sw=2
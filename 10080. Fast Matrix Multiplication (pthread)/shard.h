@@ -0,0 +1,27 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+// Matrix product sharded over worker processes, turned on by environment
+// variable MATMUL_PROCS=P with P >= 2. The first call forks P processes. Each
+// one gets its share of the CPUs in topology order and a pool of its own
+// (MATMUL_THREADS, if set, is the size of every process's pool). A, B and C
+// go through a POSIX shared-memory segment, and process p computes a block
+// of rows of C with gemm().
+//
+// The processes meet at a barrier kept in the segment, with a process-shared
+// mutex and condition variables, at the start and the end of every product.
+// A worker that dies is noticed at the barrier. The caller computes its rows
+// itself and leaves the worker out of later products, so one shard's crash
+// does not change the output.
+
+#define SHARD_MAX 64
+
+// worker processes, 0 if sharding is off
+int shard_procs(void);
+
+// C = A * B, all n x n, on the worker processes
+void shard_multiply(int n, const unsigned long *A, int lda,
+                    const unsigned long *B, int ldb, unsigned long *C,
+                    int ldc);
+
+#endif
@@ -0,0 +1,196 @@
+#include "signature.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIGNATURE_X86
+#include <immintrin.h>
+#endif
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define mini(x, y)                                                             \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    _x < _y ? _x : _y;                                                         \
+  })
+
+#define ceildivi(x, y)                                                         \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    (_x + _y - 1) / _y;                                                        \
+  })
+
+#define K 2654435761LU
+
+typedef unsigned long ulong;
+
+static ulong fpow(ulong a, ulong b) {
+  ulong ret = 1;
+  while (b) {
+    if (b & 1)
+      ret = ret * a;
+    b >>= 1, a = a * a;
+  }
+  return ret;
+}
+
+// All kernels return sum of x[t] * K^(len - t), the hash of x[0 .. len - 1]
+// started from 0. Lane l of an L-lane kernel runs its own chain over x[l],
+// x[l + L], ... with multiplier K^L; at the end lane l is weighted by
+// K^(L - l) and the ragged tail is chained on one element at a time.
+typedef ulong (*chain_fn)(const ulong *x, int len);
+
+// four independent chains hide the latency of the multiply
+static ulong chain_scalar(const ulong *x, int len) {
+  const ulong k4 = fpow(K, 4);
+  ulong h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+  int t = 0;
+  for (; t + 4 <= len; t += 4) {
+    h0 = h0 * k4 + x[t];
+    h1 = h1 * k4 + x[t + 1];
+    h2 = h2 * k4 + x[t + 2];
+    h3 = h3 * k4 + x[t + 3];
+  }
+  ulong h = h0 * k4 + h1 * fpow(K, 3) + h2 * fpow(K, 2) + h3 * K;
+  for (; t < len; t++)
+    h = (h + x[t]) * K;
+  return h;
+}
+
+#ifdef SIGNATURE_X86
+
+// AVX2 has no 64 x 64-bit multiply; the low 64 bits of x * y are
+// lo(x) * lo(y) + ((lo(x) * hi(y) + hi(x) * lo(y)) << 32)
+__attribute__((target("avx2"))) static inline __m256i mullo64(__m256i x,
+                                                              __m256i y) {
+  __m256i lolo = _mm256_mul_epu32(x, y);
+  __m256i lohi = _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32));
+  __m256i hilo = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), y);
+  return _mm256_add_epi64(
+      lolo, _mm256_slli_epi64(_mm256_add_epi64(lohi, hilo), 32));
+}
+
+// 2 x 4 lanes
+__attribute__((target("avx2"))) static ulong chain_avx2(const ulong *x,
+                                                        int len) {
+  const __m256i k8 = _mm256_set1_epi64x((long long)fpow(K, 8));
+  __m256i h0 = _mm256_setzero_si256(), h1 = _mm256_setzero_si256();
+  int t = 0;
+  for (; t + 8 <= len; t += 8) {
+    h0 = _mm256_add_epi64(mullo64(h0, k8),
+                          _mm256_loadu_si256((const __m256i *)(x + t)));
+    h1 = _mm256_add_epi64(mullo64(h1, k8),
+                          _mm256_loadu_si256((const __m256i *)(x + t + 4)));
+  }
+  ulong lane[8];
+  _mm256_storeu_si256((__m256i *)lane, h0);
+  _mm256_storeu_si256((__m256i *)(lane + 4), h1);
+  ulong h = 0;
+  for (int l = 0; l < 8; l++)
+    h = h * K + lane[l];
+  h *= K;
+  for (; t < len; t++)
+    h = (h + x[t]) * K;
+  return h;
+}
+
+// 2 x 8 lanes, vpmullq
+__attribute__((target("avx512f,avx512dq"))) static ulong
+chain_avx512(const ulong *x, int len) {
+  const __m512i k16 = _mm512_set1_epi64((long long)fpow(K, 16));
+  __m512i h0 = _mm512_setzero_si512(), h1 = _mm512_setzero_si512();
+  int t = 0;
+  for (; t + 16 <= len; t += 16) {
+    h0 = _mm512_add_epi64(_mm512_mullo_epi64(h0, k16),
+                          _mm512_loadu_si512(x + t));
+    h1 = _mm512_add_epi64(_mm512_mullo_epi64(h1, k16),
+                          _mm512_loadu_si512(x + t + 8));
+  }
+  ulong lane[16];
+  _mm512_storeu_si512(lane, h0);
+  _mm512_storeu_si512(lane + 8, h1);
+  ulong h = 0;
+  for (int l = 0; l < 16; l++)
+    h = h * K + lane[l];
+  h *= K;
+  for (; t < len; t++)
+    h = (h + x[t]) * K;
+  return h;
+}
+
+#endif // SIGNATURE_X86
+
+static chain_fn chain = chain_scalar;
+
+__attribute__((constructor)) static void signature_dispatch(void) {
+  const char *want = getenv("MATMUL_SIMD");
+#ifdef SIGNATURE_X86
+  __builtin_cpu_init();
+  int has_avx512 = __builtin_cpu_supports("avx512f") &&
+                   __builtin_cpu_supports("avx512dq");
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  if (want != NULL && strcmp(want, "scalar") == 0)
+    has_avx512 = has_avx2 = 0;
+  if (want != NULL && strcmp(want, "avx2") == 0)
+    has_avx512 = 0;
+  if (has_avx512)
+    chain = chain_avx512;
+  else if (has_avx2)
+    chain = chain_avx2;
+#else
+  (void)want;
+#endif
+}
+
+struct signature_arg {
+  int n;
+  const ulong *X;
+  int ldx;
+  int rows; // per worker
+  ulong *partial;
+};
+
+// pool job: hash of a run of rows, started from 0
+static void signature_worker(void *arg_, int tid, int nthread) {
+  const struct signature_arg *arg = arg_;
+  int n = arg->n;
+  int r0 = mini(n, tid * arg->rows), r1 = mini(n, r0 + arg->rows);
+  ulong kn = fpow(K, (ulong)n);
+  ulong h = 0;
+  for (int i = r0; i < r1; i++)
+    h = h * kn + chain(arg->X + (size_t)i * (size_t)arg->ldx, n);
+  arg->partial[tid] = h;
+  (void)nthread;
+}
+
+unsigned long signature(int n, const unsigned long *X, int ldx) {
+  if (n <= 0)
+    return 0;
+  int nthread = pool_size();
+  ulong partial[nthread];
+  struct signature_arg arg = {n, X, ldx, ceildivi(n, nthread), partial};
+  pool_run(signature_worker, &arg);
+
+  // shift each run past the ones after it: h = h * K^(run length) + partial
+  ulong h = 0;
+  for (int tid = 0; tid < nthread; tid++) {
+    int r0 = mini(n, tid * arg.rows), r1 = mini(n, r0 + arg.rows);
+    h = h * fpow(K, (ulong)(r1 - r0) * (ulong)n) + partial[tid];
+  }
+  log("signature n=%d nthread=%d h=%lu", n, nthread, h);
+  return h;
+}
+
+// vim: sw=2
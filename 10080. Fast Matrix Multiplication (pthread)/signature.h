@@ -0,0 +1,13 @@
+#ifndef _SIGNATURE_H
+#define _SIGNATURE_H
+
+// h = hash(h + x) = (h + x) * 2654435761 over the entries of the n x n
+// matrix X in row-major order, starting from h = 0.
+//
+// The chain is linear: h = sum of x_t * K^(L - t) over the L = n^2 entries,
+// so it is split into runs of rows on the worker pool, each run into
+// interleaved SIMD lanes, and the partial sums are stitched together with
+// powers of K.
+unsigned long signature(int n, const unsigned long *X, int ldx);
+
+#endif
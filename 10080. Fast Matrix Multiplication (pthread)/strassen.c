@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+
+#include "strassen.h"
+#include "gemm.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define mini(x, y)                                                             \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    _x < _y ? _x : _y;                                                         \
+  })
+
+#define ceildivi(x, y)                                                         \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    (_x + _y - 1) / _y;                                                        \
+  })
+
+// element (i, j) of X with leading dimension ldx
+#define at(X, ldx, i, j) ((X) + (size_t)(i) * (size_t)(ldx) + (size_t)(j))
+
+// with no more workers than products, a level runs its seven products side
+// by side; with more, one after the other on the whole pool
+#define NPRODUCT 7
+
+#define ALIGN 64
+
+typedef unsigned long ulong;
+
+static int cutoff = STRASSEN_CUTOFF;
+static int cutoff_env; // set from MATMUL_STRASSEN_CUTOFF
+
+static ulong *workspace;
+static size_t workspace_cap;
+
+// The recursion below runs in one of two modes: tid >= 0 means the calling
+// thread is pool worker tid working alone (inside a pool job), tid < 0 means
+// the caller drives the whole pool.
+
+// workspace elements needed by multiply_rec() for order n
+static size_t workspace_size(int tid, int n) {
+  if (n <= cutoff)
+    return 0;
+  if (n % 2)
+    return workspace_size(tid, n - 1);
+  size_t h = (size_t)n / 2, q = h * h;
+  int nthread = pool_size();
+  if (tid < 0 && nthread <= NPRODUCT)
+    return 11 * q + (size_t)nthread * workspace_size(0, n / 2);
+  return 2 * q + workspace_size(tid, n / 2);
+}
+
+enum { ADD, SUB };
+
+// Z = X op Y on rows r0 .. r1 - 1 of h-wide matrices
+static void elementwise(int op, int h, int r0, int r1, const ulong *X, int ldx,
+                        const ulong *Y, int ldy, ulong *Z, int ldz) {
+  for (int i = r0; i < r1; i++) {
+    const ulong *x = at(X, ldx, i, 0), *y = at(Y, ldy, i, 0);
+    ulong *z = at(Z, ldz, i, 0);
+    if (op == ADD)
+      for (int j = 0; j < h; j++)
+        z[j] = x[j] + y[j];
+    else
+      for (int j = 0; j < h; j++)
+        z[j] = x[j] - y[j];
+  }
+}
+
+struct elementwise_arg {
+  int op, h;
+  const ulong *X;
+  int ldx;
+  const ulong *Y;
+  int ldy;
+  ulong *Z;
+  int ldz;
+};
+
+// pool job: elementwise() on a share of the rows
+static void elementwise_worker(void *arg_, int tid, int nthread) {
+  const struct elementwise_arg *arg = arg_;
+  int rows = ceildivi(arg->h, nthread);
+  int r0 = mini(arg->h, tid * rows), r1 = mini(arg->h, r0 + rows);
+  elementwise(arg->op, arg->h, r0, r1, arg->X, arg->ldx, arg->Y, arg->ldy,
+              arg->Z, arg->ldz);
+}
+
+static void ew(int tid, int op, int h, const ulong *X, int ldx, const ulong *Y,
+               int ldy, ulong *Z, int ldz) {
+  if (tid >= 0) {
+    elementwise(op, h, 0, h, X, ldx, Y, ldy, Z, ldz);
+    return;
+  }
+  struct elementwise_arg arg = {op, h, X, ldx, Y, ldy, Z, ldz};
+  pool_run(elementwise_worker, &arg);
+}
+
+// Odd order n: C holds the product of the leading (n - 1) x (n - 1) blocks;
+// add the outer product of the last column of A and the last row of B to it
+// and fill in the last row and column of C.
+static void peel(int n, const ulong *A, int lda, const ulong *B, int ldb,
+                 ulong *C, int ldc) {
+  int m = n - 1;
+  for (int i = 0; i < m; i++) {
+    ulong a = *at(A, lda, i, m);
+    const ulong *b = at(B, ldb, m, 0);
+    ulong *c = at(C, ldc, i, 0);
+    for (int j = 0; j < m; j++)
+      c[j] += a * b[j];
+  }
+
+  ulong *c = at(C, ldc, m, 0);
+  for (int j = 0; j < m; j++)
+    c[j] = 0;
+  for (int k = 0; k < n; k++) {
+    ulong a = *at(A, lda, m, k);
+    const ulong *b = at(B, ldb, k, 0);
+    for (int j = 0; j < m; j++)
+      c[j] += a * b[j];
+  }
+
+  for (int i = 0; i < n; i++) {
+    ulong sum = 0;
+    for (int k = 0; k < n; k++)
+      sum += *at(A, lda, i, k) * *at(B, ldb, k, m);
+    *at(C, ldc, i, m) = sum;
+  }
+}
+
+static void multiply_rec(int tid, int n, const ulong *A, int lda,
+                         const ulong *B, int ldb, ulong *C, int ldc,
+                         ulong *ws);
+
+// One level with the seven products side by side on the pool (breadth
+// first). Every product gets its own destination: four go straight into the
+// quadrants of C, three into the workspace, and each worker recurses depth
+// first on its own slice of the workspace.
+struct level_arg {
+  int h;
+  const ulong *A11, *A12, *A21, *A22;
+  int lda;
+  const ulong *B11, *B12, *B21, *B22;
+  int ldb;
+  ulong *C11, *C12, *C21, *C22;
+  int ldc;
+
+  ulong *S[4], *T[4], *P1, *P5, *P7; // h x h each
+  ulong *ws;                         // per-worker workspace
+  size_t ws_size;
+  int next_product; // shared by the workers
+};
+
+// pool job: the eight operand sums, a share of the rows each
+static void sums_worker(void *arg_, int tid, int nthread) {
+  const struct level_arg *arg = arg_;
+  int h = arg->h, rows = ceildivi(h, nthread);
+  int r0 = mini(h, tid * rows), r1 = mini(h, r0 + rows);
+  for (int i = r0; i < r1; i++) {
+    const ulong *a11 = at(arg->A11, arg->lda, i, 0);
+    const ulong *a12 = at(arg->A12, arg->lda, i, 0);
+    const ulong *a21 = at(arg->A21, arg->lda, i, 0);
+    const ulong *a22 = at(arg->A22, arg->lda, i, 0);
+    const ulong *b11 = at(arg->B11, arg->ldb, i, 0);
+    const ulong *b12 = at(arg->B12, arg->ldb, i, 0);
+    const ulong *b21 = at(arg->B21, arg->ldb, i, 0);
+    const ulong *b22 = at(arg->B22, arg->ldb, i, 0);
+    ulong *s1 = at(arg->S[0], h, i, 0), *s2 = at(arg->S[1], h, i, 0);
+    ulong *s3 = at(arg->S[2], h, i, 0), *s4 = at(arg->S[3], h, i, 0);
+    ulong *t1 = at(arg->T[0], h, i, 0), *t2 = at(arg->T[1], h, i, 0);
+    ulong *t3 = at(arg->T[2], h, i, 0), *t4 = at(arg->T[3], h, i, 0);
+    for (int j = 0; j < h; j++) {
+      s1[j] = a21[j] + a22[j];
+      s2[j] = s1[j] - a11[j];
+      s3[j] = a11[j] - a21[j];
+      s4[j] = a12[j] - s2[j];
+      t1[j] = b12[j] - b11[j];
+      t2[j] = b22[j] - t1[j];
+      t3[j] = b22[j] - b12[j];
+      t4[j] = t2[j] - b21[j];
+    }
+  }
+}
+
+// pool job: take products until none are left
+static void products_worker(void *arg_, int tid, int nthread) {
+  struct level_arg *arg = arg_;
+  int h = arg->h, lda = arg->lda, ldb = arg->ldb, ldc = arg->ldc;
+  ulong *ws = arg->ws + (size_t)tid * arg->ws_size;
+  (void)nthread;
+
+  for (;;) {
+    int p = __atomic_fetch_add(&arg->next_product, 1, __ATOMIC_RELAXED);
+    log("products_worker tid=%d h=%d product=%d", tid, h, p + 1);
+    switch (p) {
+    case 0:
+      multiply_rec(tid, h, arg->A11, lda, arg->B11, ldb, arg->P1, h, ws);
+      break;
+    case 1:
+      multiply_rec(tid, h, arg->A12, lda, arg->B21, ldb, arg->C11, ldc, ws);
+      break;
+    case 2:
+      multiply_rec(tid, h, arg->S[3], h, arg->B22, ldb, arg->C12, ldc, ws);
+      break;
+    case 3:
+      multiply_rec(tid, h, arg->A22, lda, arg->T[3], h, arg->C21, ldc, ws);
+      break;
+    case 4:
+      multiply_rec(tid, h, arg->S[0], h, arg->T[0], h, arg->P5, h, ws);
+      break;
+    case 5:
+      multiply_rec(tid, h, arg->S[1], h, arg->T[1], h, arg->C22, ldc, ws);
+      break;
+    case 6:
+      multiply_rec(tid, h, arg->S[2], h, arg->T[2], h, arg->P7, h, ws);
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+// pool job: C11 = P1 + P2, C12 = U5, C21 = U6 and C22 = U7, a share of the
+// rows each; P2, P3, P4 and P6 are read from the quadrants they overwrite
+static void combine_worker(void *arg_, int tid, int nthread) {
+  const struct level_arg *arg = arg_;
+  int h = arg->h, rows = ceildivi(h, nthread);
+  int r0 = mini(h, tid * rows), r1 = mini(h, r0 + rows);
+  for (int i = r0; i < r1; i++) {
+    const ulong *p1 = at(arg->P1, h, i, 0), *p5 = at(arg->P5, h, i, 0);
+    const ulong *p7 = at(arg->P7, h, i, 0);
+    ulong *c11 = at(arg->C11, arg->ldc, i, 0);
+    ulong *c12 = at(arg->C12, arg->ldc, i, 0);
+    ulong *c21 = at(arg->C21, arg->ldc, i, 0);
+    ulong *c22 = at(arg->C22, arg->ldc, i, 0);
+    for (int j = 0; j < h; j++) {
+      ulong u2 = p1[j] + c22[j]; // P6
+      ulong u3 = u2 + p7[j];
+      ulong u4 = u2 + p5[j];
+      c11[j] = p1[j] + c11[j]; // P2
+      c12[j] = u4 + c12[j];    // P3
+      c21[j] = u3 - c21[j];    // P4
+      c22[j] = u3 + p5[j];
+    }
+  }
+}
+
+static void multiply_level(int n, const ulong *A, int lda, const ulong *B,
+                           int ldb, ulong *C, int ldc, ulong *ws) {
+  int h = n / 2;
+  size_t q = (size_t)h * (size_t)h;
+  struct level_arg arg = {
+      .h = h,
+      .A11 = A, .A12 = at(A, lda, 0, h),
+      .A21 = at(A, lda, h, 0), .A22 = at(A, lda, h, h),
+      .lda = lda,
+      .B11 = B, .B12 = at(B, ldb, 0, h),
+      .B21 = at(B, ldb, h, 0), .B22 = at(B, ldb, h, h),
+      .ldb = ldb,
+      .C11 = C, .C12 = at(C, ldc, 0, h),
+      .C21 = at(C, ldc, h, 0), .C22 = at(C, ldc, h, h),
+      .ldc = ldc,
+  };
+  for (int i = 0; i < 4; i++) {
+    arg.S[i] = ws + (size_t)i * q;
+    arg.T[i] = ws + (size_t)(4 + i) * q;
+  }
+  arg.P1 = ws + 8 * q;
+  arg.P5 = ws + 9 * q;
+  arg.P7 = ws + 10 * q;
+  arg.ws = ws + 11 * q;
+  arg.ws_size = workspace_size(0, h);
+
+  pool_run(sums_worker, &arg);
+  pool_run(products_worker, &arg);
+  pool_run(combine_worker, &arg);
+}
+
+// C = A * B of order n, using ws for temporaries (workspace_size(tid, n)
+// elements)
+static void multiply_rec(int tid, int n, const ulong *A, int lda,
+                         const ulong *B, int ldb, ulong *C, int ldc,
+                         ulong *ws) {
+  if (n <= cutoff) {
+    if (tid >= 0)
+      gemm_local(tid, n, n, n, A, lda, B, ldb, C, ldc);
+    else
+      gemm(n, n, n, A, lda, B, ldb, C, ldc);
+    return;
+  }
+  if (n % 2) {
+    multiply_rec(tid, n - 1, A, lda, B, ldb, C, ldc, ws);
+    peel(n, A, lda, B, ldb, C, ldc);
+    return;
+  }
+  if (tid < 0 && pool_size() <= NPRODUCT) {
+    multiply_level(n, A, lda, B, ldb, C, ldc, ws);
+    return;
+  }
+
+  // Depth first, with the schedule of Douglas et al. that needs only two
+  // temporaries: X for sums of A quadrants (and P1), Y for sums of B
+  // quadrants; the quadrants of C hold the other products until they are
+  // combined.
+  int h = n / 2;
+  size_t q = (size_t)h * (size_t)h;
+  const ulong *A11 = A, *A12 = at(A, lda, 0, h);
+  const ulong *A21 = at(A, lda, h, 0), *A22 = at(A, lda, h, h);
+  const ulong *B11 = B, *B12 = at(B, ldb, 0, h);
+  const ulong *B21 = at(B, ldb, h, 0), *B22 = at(B, ldb, h, h);
+  ulong *C11 = C, *C12 = at(C, ldc, 0, h);
+  ulong *C21 = at(C, ldc, h, 0), *C22 = at(C, ldc, h, h);
+  ulong *X = ws, *Y = ws + q, *rest = ws + 2 * q;
+
+  ew(tid, SUB, h, A11, lda, A21, lda, X, h);                   // S3
+  ew(tid, SUB, h, B22, ldb, B12, ldb, Y, h);                   // T3
+  multiply_rec(tid, h, X, h, Y, h, C21, ldc, rest);            // P7
+  ew(tid, ADD, h, A21, lda, A22, lda, X, h);                   // S1
+  ew(tid, SUB, h, B12, ldb, B11, ldb, Y, h);                   // T1
+  multiply_rec(tid, h, X, h, Y, h, C22, ldc, rest);            // P5
+  ew(tid, SUB, h, X, h, A11, lda, X, h);                       // S2
+  ew(tid, SUB, h, B22, ldb, Y, h, Y, h);                       // T2
+  multiply_rec(tid, h, X, h, Y, h, C12, ldc, rest);            // P6
+  ew(tid, SUB, h, A12, lda, X, h, X, h);                       // S4
+  multiply_rec(tid, h, X, h, B22, ldb, C11, ldc, rest);        // P3
+  multiply_rec(tid, h, A11, lda, B11, ldb, X, h, rest);        // P1
+  ew(tid, ADD, h, X, h, C12, ldc, C12, ldc);                   // U2
+  ew(tid, ADD, h, C12, ldc, C21, ldc, C21, ldc);               // U3
+  ew(tid, ADD, h, C12, ldc, C22, ldc, C12, ldc);               // U4
+  ew(tid, ADD, h, C21, ldc, C22, ldc, C22, ldc);               // U7
+  ew(tid, ADD, h, C12, ldc, C11, ldc, C12, ldc);               // U5
+  ew(tid, SUB, h, Y, h, B21, ldb, Y, h);                       // T4
+  multiply_rec(tid, h, A22, lda, Y, h, C11, ldc, rest);        // P4
+  ew(tid, SUB, h, C21, ldc, C11, ldc, C21, ldc);               // U6
+  multiply_rec(tid, h, A12, lda, B21, ldb, C11, ldc, rest);    // P2
+  ew(tid, ADD, h, X, h, C11, ldc, C11, ldc);                   // U1
+}
+
+__attribute__((constructor)) static void strassen_init(void) {
+  const char *env = getenv("MATMUL_STRASSEN_CUTOFF");
+  if (env != NULL)
+    cutoff = atoi(env), cutoff_env = 1;
+  // the half-size products must still be large enough to recurse on
+  if (cutoff < 2)
+    cutoff = 2;
+  log("strassen cutoff=%d", cutoff);
+}
+
+void strassen_cutoff(int n) {
+  if (cutoff_env)
+    return;
+  cutoff = n < 2 ? 2 : n;
+  log("strassen cutoff=%d", cutoff);
+}
+
+void strassen(int n, const unsigned long *A, int lda, const unsigned long *B,
+              int ldb, unsigned long *C, int ldc) {
+  // a single worker is always the caller, tid 0
+  int tid = pool_size() == 1 ? 0 : -1;
+  size_t need = workspace_size(tid, n);
+  if (need > workspace_cap) {
+    free(workspace);
+    if (posix_memalign((void **)&workspace, ALIGN, sizeof(ulong) * need) != 0) {
+      perror("posix_memalign");
+      exit(1);
+    }
+    workspace_cap = need;
+  }
+  log("strassen n=%d cutoff=%d workspace=%zu", n, cutoff, need);
+  multiply_rec(tid, n, A, lda, B, ldb, C, ldc, workspace);
+}
+
+// vim: sw=2
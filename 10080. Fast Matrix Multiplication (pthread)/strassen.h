@@ -0,0 +1,25 @@
+#ifndef _STRASSEN_H
+#define _STRASSEN_H
+
+// Strassen-Winograd recursion (7 half-size products and 15 additions per
+// level) over gemm(). The arithmetic is the ring of integers modulo 2^64, so
+// the result is bit-identical to the plain product.
+//
+// Matrices of order at most the cutoff are handed to gemm(); odd orders peel
+// off the last row and column. The cutoff defaults to STRASSEN_CUTOFF and is
+// read from environment variable MATMUL_STRASSEN_CUTOFF if set (a value of N
+// or more disables the recursion). strassen_cutoff() changes it at run time
+// unless the environment variable is set.
+//
+// All temporaries live in one workspace, allocated on the first call and
+// grown only when a larger order comes along.
+
+#define STRASSEN_CUTOFF 512
+
+void strassen_cutoff(int n);
+
+// C = A * B, all n x n
+void strassen(int n, const unsigned long *A, int lda, const unsigned long *B,
+              int ldb, unsigned long *C, int ldc);
+
+#endif
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include "topo.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// first integer in /sys/devices/system/cpu/cpu<cpu>/<name>, or def
+static int read_int(int cpu, const char *name, int def) {
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/%s", cpu, name);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return def;
+  int v;
+  if (fscanf(f, "%d", &v) != 1)
+    v = def;
+  fclose(f);
+  return v;
+}
+
+// the node<N> entry in the directory of the CPU
+static int read_node(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+  int node = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (sscanf(e->d_name, "node%d", &node) == 1)
+      break;
+  }
+  closedir(dir);
+  return node;
+}
+
+// number of CPUs below cpu in its thread_siblings_list ("0,4" or "0-1")
+static int read_smt(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list",
+           cpu);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  int rank = 0, lo, hi;
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%d", &hi) != 1)
+        break;
+      c = fgetc(f);
+    }
+    for (int s = lo; s <= hi; s++)
+      rank += s < cpu;
+    if (c != ',')
+      break;
+  }
+  fclose(f);
+  return rank;
+}
+
+static int cmp_cpu(const void *a_, const void *b_) {
+  const struct topo_cpu *a = a_, *b = b_;
+  if (a->node != b->node)
+    return a->node - b->node;
+  if (a->smt != b->smt)
+    return a->smt - b->smt;
+  if (a->core != b->core)
+    return a->core - b->core;
+  return a->cpu - b->cpu;
+}
+
+int topo_cpus(struct topo_cpu **cpus) {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    *cpus = NULL;
+    return 0;
+  }
+  int n = 0;
+  *cpus = malloc(sizeof(struct topo_cpu) * (size_t)CPU_COUNT(&set));
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET((size_t)cpu, &set))
+      continue;
+    struct topo_cpu *c = &(*cpus)[n++];
+    c->cpu = cpu;
+    c->node = read_node(cpu);
+    // core ids repeat across packages
+    c->core = read_int(cpu, "topology/physical_package_id", 0) * 65536 +
+              read_int(cpu, "topology/core_id", cpu);
+    c->smt = read_smt(cpu);
+  }
+  qsort(*cpus, (size_t)n, sizeof(struct topo_cpu), cmp_cpu);
+  for (int i = 0; i < n; i++)
+    log("topo %d: cpu=%d node=%d core=%d smt=%d", i, (*cpus)[i].cpu,
+        (*cpus)[i].node, (*cpus)[i].core, (*cpus)[i].smt);
+  return n;
+}
+
+// whether v is in a list such as "0,2-3"
+static int in_list(const char *list, int v) {
+  for (;;) {
+    char *end;
+    long lo = strtol(list, &end, 10), hi = lo;
+    if (end == list)
+      return 0;
+    if (*end == '-') {
+      list = end + 1;
+      hi = strtol(list, &end, 10);
+      if (end == list)
+        return 0;
+    }
+    if (lo <= v && v <= hi)
+      return 1;
+    if (*end != ',')
+      return 0;
+    list = end + 1;
+  }
+}
+
+int topo_affinity(struct topo_cpu **cpus, int *pin) {
+  const char *env = getenv("TOPO_AFFINITY");
+  const char *nodes = NULL;
+  int all_threads = 0;
+  *pin = 1;
+  if (env != NULL && *env != '\0') {
+    size_t len = strcspn(env, ":");
+    if (env[len] == ':')
+      nodes = env + len + 1;
+    if (len == 7 && strncmp(env, "threads", len) == 0)
+      all_threads = 1;
+    else if (len == 4 && strncmp(env, "none", len) == 0)
+      all_threads = 1, *pin = 0;
+    else if (!(len == 5 && strncmp(env, "cores", len) == 0))
+      fprintf(stderr, "TOPO_AFFINITY=%s: unknown policy, using cores\n", env);
+  }
+
+  int ncpu = topo_cpus(cpus), n = 0;
+  for (int i = 0; i < ncpu; i++) {
+    struct topo_cpu c = (*cpus)[i];
+    if (nodes != NULL && !in_list(nodes, c.node))
+      continue;
+    // the CPUs come thread rank by thread rank, so the first one seen of a
+    // core is its lowest thread we may run on
+    int seen = 0;
+    for (int j = 0; j < n && !all_threads && !seen; j++)
+      seen = (*cpus)[j].node == c.node && (*cpus)[j].core == c.core;
+    if (!seen)
+      (*cpus)[n++] = c;
+  }
+  if (n == 0 && ncpu > 0) {
+    fprintf(stderr, "TOPO_AFFINITY=%s: no CPU on these nodes, using all\n",
+            env);
+    free(*cpus);
+    n = topo_cpus(cpus);
+  }
+  for (int i = 0; i < n; i++)
+    log("affinity %d: cpu=%d node=%d pin=%d", i, (*cpus)[i].cpu,
+        (*cpus)[i].node, *pin);
+  return n;
+}
+
+int topo_pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET((size_t)cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// vim: sw=2
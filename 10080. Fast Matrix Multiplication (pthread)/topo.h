@@ -0,0 +1,37 @@
+#ifndef _TOPO_H
+#define _TOPO_H
+
+// Processor topology, read from /sys/devices/system/cpu.
+
+struct topo_cpu {
+  int cpu;  // logical CPU number
+  int node; // NUMA node, 0 if the kernel exposes none
+  int core; // core id within the package
+  int smt;  // rank among the hardware threads of its core
+};
+
+// CPUs the process is allowed to run on, in the order workers should be
+// placed: node by node, and within a node the first hardware thread of every
+// core before the second thread of any core. Returns the count and a malloc'd
+// array in *cpus.
+int topo_cpus(struct topo_cpu **cpus);
+
+// Placement policy for a program's workers, from environment variable
+// TOPO_AFFINITY=<policy>[:<nodes>]:
+//
+//   cores    one hardware thread of every core (the default)
+//   threads  every hardware thread, the first of every core first
+//   none     the same CPUs as threads, but workers are not pinned
+//
+// <nodes> restricts the CPUs to NUMA nodes, as a list such as "0" or "0,2-3";
+// by default every node the process may run on is used.
+//
+// Returns the count and a malloc'd array in *cpus of the CPUs to place
+// workers on, in the order of topo_cpus(), worker i on the i-th. *pin is set
+// to whether the workers should be pinned.
+int topo_affinity(struct topo_cpu **cpus, int *pin);
+
+// pin the calling thread to cpu; returns 0 on success
+int topo_pin(int cpu);
+
+#endif
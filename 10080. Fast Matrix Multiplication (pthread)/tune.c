@@ -0,0 +1,109 @@
+#include "tune.h"
+#include "gemm.h"
+#include "strassen.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+const char *tune_path(void) {
+  const char *env = getenv("MATMUL_PROFILE");
+  return env != NULL ? env : TUNE_PROFILE;
+}
+
+static int cmp_entry(const void *a_, const void *b_) {
+  const struct tune_entry *a = a_, *b = b_;
+  return a->n - b->n;
+}
+
+int tune_load(const char *path, struct tune_profile *p) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  *p = (struct tune_profile){0};
+  int cap = 0, lineno = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+      *hash = '\0';
+    char layout[16];
+    struct tune_entry e;
+    int threads;
+    if (sscanf(line, " threads %d", &threads) == 1 && threads > 0) {
+      p->threads = threads;
+      continue;
+    }
+    if (sscanf(line, "%d %15s %d %d %d %d", &e.n, layout, &e.cutoff, &e.kc,
+               &e.mc, &e.nc) == 6 &&
+        e.n > 0 &&
+        (strcmp(layout, "rows") == 0 || strcmp(layout, "morton") == 0)) {
+      e.morton = strcmp(layout, "morton") == 0;
+      if (p->count == cap) {
+        cap = cap ? 2 * cap : 8;
+        p->entry = realloc(p->entry, sizeof(struct tune_entry) * (size_t)cap);
+      }
+      p->entry[p->count++] = e;
+      continue;
+    }
+    if (strspn(line, " \t\r\n") != strlen(line)) {
+      fprintf(stderr, "%s:%d: malformed line, profile ignored\n", path, lineno);
+      fclose(f);
+      free(p->entry);
+      *p = (struct tune_profile){0};
+      return -1;
+    }
+  }
+  fclose(f);
+  qsort(p->entry, (size_t)p->count, sizeof(struct tune_entry), cmp_entry);
+  log("tune_load %s threads=%d entries=%d", path, p->threads, p->count);
+  return 0;
+}
+
+int tune_save(const char *path, const struct tune_profile *p) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf(f, "# written by matrix_tune\n");
+  if (p->threads > 0)
+    fprintf(f, "threads %d\n", p->threads);
+  fprintf(f, "# n layout cutoff kc mc nc\n");
+  for (int i = 0; i < p->count; i++) {
+    const struct tune_entry *e = &p->entry[i];
+    fprintf(f, "%d %s %d %d %d %d\n", e->n, e->morton ? "morton" : "rows",
+            e->cutoff, e->kc, e->mc, e->nc);
+  }
+  if (fclose(f) != 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+const struct tune_entry *tune_lookup(const struct tune_profile *p, int n) {
+  if (p->count == 0)
+    return NULL;
+  int i = 0;
+  while (i + 1 < p->count && p->entry[i + 1].n <= n)
+    i++;
+  return &p->entry[i];
+}
+
+void tune_apply(const struct tune_entry *e) {
+  gemm_blocking(e->kc, e->mc, e->nc);
+  strassen_cutoff(e->cutoff > 0 ? e->cutoff : INT_MAX);
+}
+
+// vim: sw=2
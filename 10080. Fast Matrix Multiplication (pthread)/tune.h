@@ -0,0 +1,51 @@
+#ifndef _TUNE_H
+#define _TUNE_H
+
+// Tuning profile: for each tuned order, the parameters that multiplied
+// fastest on this machine. matrix_tune measures and writes it, and
+// matrix_fast loads it at startup.
+//
+// The file is named by environment variable MATMUL_PROFILE, TUNE_PROFILE in
+// the current directory by default. It is text, '#' starts a comment:
+//
+//   threads <workers>
+//   <n> <rows|morton> <Strassen cutoff or 0> <kc> <mc> <nc>
+//   ...
+//
+// An order without an entry of its own uses the entry of the largest tuned
+// order below it, or of the smallest one if there is none. Environment
+// variables MATMUL_THREADS, MATMUL_LAYOUT and MATMUL_STRASSEN_CUTOFF override
+// the profile.
+
+#define TUNE_PROFILE "matrix_fast.profile"
+
+struct tune_entry {
+  int n;
+  int morton; // Morton layout rather than row major
+  int cutoff; // Strassen cutoff, 0 for no recursion
+  int kc, mc, nc; // gemm blocking
+};
+
+struct tune_profile {
+  int threads; // 0 if not given
+  int count;
+  struct tune_entry *entry; // ascending n
+};
+
+// path of the profile
+const char *tune_path(void);
+
+// Returns 0 and fills *p, or -1 if the file cannot be read or is malformed
+// (with a message in the latter case).
+int tune_load(const char *path, struct tune_profile *p);
+
+// returns 0 on success, -1 with a message otherwise
+int tune_save(const char *path, const struct tune_profile *p);
+
+// entry for order n, NULL if the profile is empty
+const struct tune_entry *tune_lookup(const struct tune_profile *p, int n);
+
+// hand the gemm blocking and Strassen cutoff of e to gemm and strassen
+void tune_apply(const struct tune_entry *e);
+
+#endif
@@ -0,0 +1,74 @@
+#include "worksteal.h"
+#include "pool.h"
+
+#include <stdio.h>
+
+#define NDEBUG
+
+#ifndef NDEBUG
+#define log(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#else
+#define log(...)
+#endif
+
+#define RUN(next, end) ((unsigned long)(unsigned)(end) << 32 | (unsigned)(next))
+#define NEXT(run) ((int)(unsigned)(run))
+#define END(run) ((int)((run) >> 32))
+
+void worksteal_init(struct worksteal_deque *dq, int nworker, const int *first) {
+  for (int w = 0; w < nworker; w++)
+    __atomic_store_n(&dq[w].run, RUN(first[w], first[w + 1]), __ATOMIC_RELAXED);
+}
+
+// front of the own run
+static int pop(struct worksteal_deque *dq) {
+  unsigned long run = __atomic_load_n(&dq->run, __ATOMIC_ACQUIRE);
+  while (NEXT(run) < END(run)) {
+    if (__atomic_compare_exchange_n(&dq->run, &run,
+                                    RUN(NEXT(run) + 1, END(run)), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return NEXT(run);
+  }
+  return -1;
+}
+
+// back half of the victim's run -> [*lo, *hi)
+static int steal(struct worksteal_deque *victim, int *lo, int *hi) {
+  unsigned long run = __atomic_load_n(&victim->run, __ATOMIC_ACQUIRE);
+  while (NEXT(run) < END(run)) {
+    int half = (END(run) - NEXT(run) + 1) / 2;
+    if (__atomic_compare_exchange_n(&victim->run, &run,
+                                    RUN(NEXT(run), END(run) - half), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *lo = END(run) - half;
+      *hi = END(run);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int worksteal_next(struct worksteal_deque *dq, int nworker, int self) {
+  int t = pop(&dq[self]);
+  if (t >= 0 || nworker == 1)
+    return t;
+
+  // Own deque is empty, so nobody steals from it: the stolen run minus the
+  // task returned now can be stored as the new run. Tasks in flight between
+  // two deques are never lost, only invisible to a worker that gives up.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int d = 1; d < nworker; d++) {
+      int v = (self + d) % nworker, lo, hi;
+      if ((pool_node(v) == pool_node(self)) != (pass == 0))
+        continue;
+      if (steal(&dq[v], &lo, &hi)) {
+        log("worksteal_next worker=%d stole %d..%d from %d", self, lo, hi - 1, v);
+        __atomic_store_n(&dq[self].run, RUN(lo + 1, hi), __ATOMIC_RELEASE);
+        return lo;
+      }
+    }
+  }
+  return -1;
+}
+
+// vim: sw=2
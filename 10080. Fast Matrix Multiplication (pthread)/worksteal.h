@@ -0,0 +1,26 @@
+#ifndef _WORKSTEAL_H
+#define _WORKSTEAL_H
+
+// Work-stealing scheduler for the tasks of one pool job.
+//
+// Tasks are numbered 0 .. ntask - 1, in the order that keeps related tasks
+// (the tiles of one row of C) next to each other. Each worker starts with a
+// contiguous run of them in its deque and pops from the front. An idle
+// worker steals the back half of another worker's run, trying the workers on
+// its own node first, so what it takes is again a contiguous run, far from
+// where the owner is working.
+//
+// A deque is just the bounds of a run, packed into one word and updated with
+// compare-and-swap; there are no pushes once the job has started.
+
+struct worksteal_deque {
+  unsigned long run; // (end << 32) | next
+} __attribute__((aligned(64)));
+
+// deal tasks first[w] .. first[w + 1] - 1 to worker w, for nworker workers
+void worksteal_init(struct worksteal_deque *dq, int nworker, const int *first);
+
+// the next task for worker self, or -1 when every deque is empty
+int worksteal_next(struct worksteal_deque *dq, int nworker, int self);
+
+#endif
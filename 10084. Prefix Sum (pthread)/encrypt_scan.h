@@ -0,0 +1,155 @@
+#ifndef _ENCRYPT_SCAN_H
+#define _ENCRYPT_SCAN_H
+
+// Prefix sum of the encrypted values of a run of consecutive integers:
+//
+//   arr[i] = encrypt(m, key) + encrypt(m + 1, key) + ... + encrypt(m + i, key)
+//
+// for i in [0, len), returning the sum of the whole run. On x86 processors
+// with AVX2 the run goes 8 values at a time: the rotate of encrypt() is a
+// pair of variable shifts by the broadcast key & 31, and the 8 values are
+// scanned in the register with shifts and adds before the carry from the
+// previous 8 is added. Other processors take the scalar loop, chosen at run
+// time.
+//
+// encrypt_scan_hash() folds the same prefix sums into the hash output()
+// prints instead of storing them (see below).
+
+#include "utils.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// prefix sums of the 8 encrypted values in vm, plus carry
+__attribute__((target("avx2"))) static inline __m256i
+encrypt_scan8_avx2(__m256i vm, __m256i vkey, __m256i left, __m256i right,
+                   __m256i carry) {
+  // a shift by 32 gives 0, so key & 31 == 0 leaves m as it is
+  __m256i x = _mm256_or_si256(_mm256_sllv_epi32(vm, left),
+                              _mm256_srlv_epi32(vm, right));
+  x = _mm256_xor_si256(_mm256_add_epi32(x, vkey), vkey);
+  // scan each 128-bit lane, then add the low lane's sum to the high lane
+  x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+  x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+  __m256i low = _mm256_permute2x128_si256(x, x, 0x08);
+  x = _mm256_add_epi32(x, _mm256_shuffle_epi32(low, 0xff));
+  return _mm256_add_epi32(x, carry);
+}
+
+#define ENCRYPT_SCAN_AVX2_SETUP(m, key)                                        \
+  const __m256i vkey = _mm256_set1_epi32((int)(key));                          \
+  const __m256i left = _mm256_set1_epi32((int)((key) & 31));                   \
+  const __m256i right = _mm256_set1_epi32((int)(32 - ((key) & 31)));           \
+  const __m256i eight = _mm256_set1_epi32(8);                                  \
+  const __m256i last = _mm256_set1_epi32(7);                                   \
+  __m256i vm = _mm256_add_epi32(_mm256_set1_epi32((int)(m)),                   \
+                                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));    \
+  __m256i carry = _mm256_setzero_si256()
+
+__attribute__((target("avx2"))) static inline uint32_t
+encrypt_scan_avx2(uint32_t *arr, uint32_t m, int len, uint32_t key) {
+  ENCRYPT_SCAN_AVX2_SETUP(m, key);
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256i x = encrypt_scan8_avx2(vm, vkey, left, right, carry);
+    _mm256_storeu_si256((__m256i *)(arr + i), x);
+    carry = _mm256_permutevar8x32_epi32(x, last);
+    vm = _mm256_add_epi32(vm, eight);
+  }
+  uint32_t sum = (uint32_t)_mm256_cvtsi256_si32(carry);
+  for (; i < len; i++) {
+    sum += encrypt(m + (uint32_t)i, key);
+    arr[i] = sum;
+  }
+  return sum;
+}
+#endif
+
+static inline uint32_t encrypt_scan(uint32_t *arr, uint32_t m, int len,
+                                    uint32_t key) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2"))
+    return encrypt_scan_avx2(arr, m, len, key);
+#endif
+  uint32_t sum = 0;
+  for (int i = 0; i < len; i++) {
+    sum += encrypt(m + (uint32_t)i, key);
+    arr[i] = sum;
+  }
+  return sum;
+}
+
+// The hash of output(), of a run x[0..len):
+//
+//   hash(x) = x[0] * SKEY^(len - 1) + ... + x[len - 2] * SKEY + x[len - 1]
+//
+// all mod 2^32. It is linear, so adding c to every element adds
+// c * skey_ones(len), and the hash of two runs one after the other is
+// hash(a) * SKEY^len(b) + hash(b).
+#define SKEY 10007 // as in secret.c
+
+static inline uint32_t skey_pow(int e) {
+  uint32_t ret = 1, a = SKEY;
+  for (; e > 0; e >>= 1, a *= a)
+    if (e & 1)
+      ret *= a;
+  return ret;
+}
+
+// SKEY^(len - 1) + ... + SKEY + 1, the hash of len ones
+static inline uint32_t skey_ones(int len) {
+  // halve: ones(2k) = ones(k) * (SKEY^k + 1)
+  if (len <= 0)
+    return 0;
+  if (len & 1)
+    return skey_ones(len - 1) * SKEY + 1;
+  return skey_ones(len / 2) * (skey_pow(len / 2) + 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Lane j holds the hash, with SKEY^8 for SKEY, of elements j, j + 8, ... of
+// the vector part; weighting lane j by SKEY^(7 - j) gives the hash of it all.
+__attribute__((target("avx2"))) static inline uint32_t
+encrypt_scan_hash_avx2(uint32_t m, int len, uint32_t key, uint32_t *sum) {
+  ENCRYPT_SCAN_AVX2_SETUP(m, key);
+  const __m256i skey8 = _mm256_set1_epi32((int)skey_pow(8));
+  __m256i h = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256i x = encrypt_scan8_avx2(vm, vkey, left, right, carry);
+    h = _mm256_add_epi32(_mm256_mullo_epi32(h, skey8), x);
+    carry = _mm256_permutevar8x32_epi32(x, last);
+    vm = _mm256_add_epi32(vm, eight);
+  }
+  uint32_t lane[8], hash = 0, s = (uint32_t)_mm256_cvtsi256_si32(carry);
+  _mm256_storeu_si256((__m256i *)lane, h);
+  for (int j = 0; j < 8; j++)
+    hash = hash * SKEY + lane[j];
+  for (; i < len; i++) {
+    s += encrypt(m + (uint32_t)i, key);
+    hash = hash * SKEY + s;
+  }
+  *sum = s;
+  return hash;
+}
+#endif
+
+// hash of the prefix sums encrypt_scan() would store; *sum gets their last
+static inline uint32_t encrypt_scan_hash(uint32_t m, int len, uint32_t key,
+                                         uint32_t *sum) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2"))
+    return encrypt_scan_hash_avx2(m, len, key, sum);
+#endif
+  uint32_t s = 0, hash = 0;
+  for (int i = 0; i < len; i++) {
+    s += encrypt(m + (uint32_t)i, key);
+    hash = hash * SKEY + s;
+  }
+  *sum = s;
+  return hash;
+}
+
+#endif
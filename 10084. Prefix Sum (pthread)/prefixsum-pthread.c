@@ -1,12 +1,9 @@
 #define _GNU_SOURCE
 
-#ifdef __linux__
-#include <sched.h>
-#endif
-
+#include "encrypt_scan.h"
+#include "topo.h"
 #include "utils.h"
 
-#include <assert.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,6 +11,7 @@
 #include <string.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #define NDEBUG
 
@@ -43,127 +41,314 @@
 #endif
 
 #define MAXN 10000005
-#define MAX_THREAD 6
 
-struct argument {
-  uint32_t *arr;
-  int start_idx; // index in original array
-  int len;
-  uint32_t val; // key / value to add
+// polls of a barrier before sleeping on its condition variable, on the order
+// of ten microseconds
+#define SPIN_ITERS 4000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Sense-reversing barrier: every thread flips its private sense on arrival,
+// and the last one to arrive resets the count and publishes the new sense.
+// Waiters spin on the shared sense for a while, then sleep until it flips, so
+// the team costs nothing between queries while output() and scanf() run.
+struct barrier {
+  int nthread;
+  int count; // threads still to arrive
+  int sense;
+  int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
 };
 
-// calculate prefix sum of each subinterval
-void *calc_prefix_sub(void *arg_) {
-  struct argument *arg = arg_;
-  uint32_t sum = 0;
-  log("calc_prefix_sub start_idx=%d len=%d key=%u", arg->start_idx, arg->len,
-      arg->val);
-  for (int i = 0; i < arg->len; i++) {
-    sum += encrypt(arg->start_idx + i, arg->val);
-    arg->arr[i] = sum;
+void barrier_wait(struct barrier *b, int *local_sense) {
+  int sense = *local_sense = !*local_sense;
+  if (__atomic_sub_fetch(&b->count, 1, __ATOMIC_ACQ_REL) == 0) {
+    __atomic_store_n(&b->count, b->nthread, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&b->lock);
+    __atomic_store_n(&b->sense, sense, __ATOMIC_RELEASE);
+    if (b->sleepers > 0)
+      pthread_cond_broadcast(&b->wake);
+    pthread_mutex_unlock(&b->lock);
+    return;
   }
-  return NULL;
-}
-
-// add each element in arr[0..len] by val
-void *array_range_add(void *arg_) {
-  struct argument *arg = arg_;
-  log("array_range_add start_idx=%d len=%d val=%u", arg->start_idx, arg->len,
-      arg->val);
-  for (int i = 0; i < arg->len; i++) {
-    arg->arr[i] += arg->val;
+  for (int i = 0; i < SPIN_ITERS; i++) {
+    if (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) == sense)
+      return;
+    cpu_relax();
   }
-  return NULL;
+  pthread_mutex_lock(&b->lock);
+  b->sleepers++;
+  while (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != sense)
+    pthread_cond_wait(&b->wake, &b->lock);
+  b->sleepers--;
+  pthread_mutex_unlock(&b->lock);
 }
 
-// putting data shared by threads at global is faster
-uint32_t prefix_sum[MAXN];
-uint32_t prefix_sum_sub[MAX_THREAD]; // prefix sum of subinterval sum
-struct argument arguments[MAX_THREAD];
+// Single-pass scan, after the decoupled look-back of Merrill and Garland:
+// CHUNK-element chunks are claimed in order from a shared counter. A chunk is
+// scanned into a private buffer, its aggregate published, the offset
+// gathered by looking back over the status of the chunks before it, its
+// inclusive prefix published, and only then is it written to prefix_sum, so
+// every element is written once and never read back.
+//
+// The status word of a chunk holds the query number in the top 30 bits, one
+// of STATUS_* in the next two and the value in the low 32; words left over
+// from an earlier query never match, so nothing is reset between queries.
+#define CHUNK 4096 // a 16 KiB buffer stays in L1
+#define NUM_CHUNK ((MAXN + CHUNK - 1) / CHUNK)
+#define STATUS_AGGREGATE 1UL // value is the sum of the chunk
+#define STATUS_PREFIX 2UL    // value is the sum up to the end of the chunk
 
-int main() {
-#ifdef __linux__
-  // only dispatch to cores on the same CPU for stability
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  for (int i = 0; i < 6; i++)
-    CPU_SET(i, &cpuset);
-  assert(sched_setaffinity(0, sizeof(cpuset), &cpuset) == 0);
-#endif
+uint64_t chunk_status[NUM_CHUNK];
+
+// the sum of a block, one cache line each so that the threads do not
+// invalidate each other's
+struct block_sum {
+  uint32_t val;
+  uint32_t hash; // of the block's prefix sums, for SCAN_STREAM
+} __attribute__((aligned(64)));
+
+enum scan_mode {
+  SCAN_TWOPASS,  // the three phases of scan()
+  SCAN_LOOKBACK, // scan_lookback()
+  SCAN_STREAM,   // scan_stream(): the hash only, prefix_sum is not stored
+};
 
+// The team lives for the whole run: thread 0 is main(), which posts each
+// query and then joins the others in the three phases of the scan.
+struct team {
+  int nthread;
+  pthread_t *threads;
+  int *cpu; // CPU thread t is pinned to, -1 if not pinned
+  struct barrier barrier;
+  struct block_sum *sum; // sum of block t, then the offset of block t
+
+  enum scan_mode mode;
+
+  // the current query, written by thread 0 before the start barrier
   int n;
   uint32_t key;
+  int quit;
+  uint64_t query;  // number of the query, for the status words
+  int next_chunk; // next chunk to claim
+  uint32_t hash;  // result of SCAN_STREAM, written by thread 0
+} team;
 
-  pthread_t pool[MAX_THREAD];
+// putting data shared by threads at global is faster
+uint32_t prefix_sum[MAXN];
 
-  log("MAX_THREAD=%d", MAX_THREAD);
+// prefix sum of arr[0..len), the encrypted values of start_idx onwards;
+// returns the sum of the whole subinterval
+uint32_t calc_prefix_sub(uint32_t *arr, int start_idx, int len, uint32_t key) {
+  return encrypt_scan(arr, (uint32_t)start_idx, len, key);
+}
 
-  while (scanf("%d %" PRIu32, &n, &key) == 2) {
-    int block_size = ceildivi(n, MAX_THREAD);
-    int num_thread = ceildivi(n, block_size);
-    int remain_size = num_thread * block_size - n;
-
-    log("n=%d block_size=%d num_thread=%d remain_size=%d", n, block_size,
-        num_thread, remain_size);
-
-    // calculate prefix sum of each subinterval
-    // O(n/p)
-    for (int i = 0; i < num_thread; i++) {
-      int start_idx = 1 + block_size * i;
-      arguments[i].arr = &prefix_sum[start_idx];
-      arguments[i].start_idx = start_idx;
-      arguments[i].len = block_size - (i == num_thread - 1) * remain_size;
-      arguments[i].val = key;
-    }
-    for (int i = 0; i < num_thread; i++) {
-      pthread_create(&pool[i], NULL, calc_prefix_sub, &arguments[i]);
-    }
-    for (int i = 0; i < num_thread; i++) {
-      pthread_join(pool[i], NULL);
-    }
+// add val to each element in arr[0..len)
+void array_range_add(uint32_t *arr, int len, uint32_t val) {
+  for (int i = 0; i < len; i++)
+    arr[i] += val;
+}
 
-    // calculate prefix sum of subinterval sum
-    // O(log p)
-    for (int i = 0; i < num_thread; i++) {
-      prefix_sum_sub[i] = prefix_sum[1 + block_size * (i + 1) - 1];
-    }
-    for (int step = 1; step < MAX_THREAD; step *= 2) {
-      int num_thread_2 = num_thread - step;
-      for (int i = 0; i < num_thread_2; i++) {
-        // get all val before launching threads to prevent race condition
-        arguments[i].arr = &prefix_sum_sub[i + step];
-        arguments[i].start_idx = i + step;
-        arguments[i].len = 1;
-        arguments[i].val = prefix_sum_sub[i];
-      }
-      for (int i = 0; i < num_thread_2; i++) {
-        pthread_create(&pool[i], NULL, array_range_add, &arguments[i]);
-      }
-      for (int i = 0; i < num_thread_2; i++) {
-        pthread_join(pool[i], NULL);
-      }
-      log("");
+// prefix sum of blocks of prefix_sum[1..n], one block per thread
+void scan(int tid, int *sense) {
+  int n = team.n, nthread = team.nthread;
+  uint32_t key = team.key;
+  int block_size = ceildivi(n, nthread);
+  int lo = 1 + block_size * tid, hi = min(n, lo + block_size - 1);
+  log("scan tid=%d lo=%d hi=%d", tid, lo, hi);
+
+  // prefix sum of each block
+  // O(n/p)
+  team.sum[tid].val = calc_prefix_sub(&prefix_sum[lo], lo, hi - lo + 1, key);
+  barrier_wait(&team.barrier, sense);
+
+  // exclusive prefix sum of the block sums, serially
+  // O(p)
+  if (tid == 0) {
+    uint32_t offset = 0;
+    for (int t = 0; t < nthread; t++) {
+      uint32_t s = team.sum[t].val;
+      team.sum[t].val = offset;
+      offset += s;
     }
+  }
+  barrier_wait(&team.barrier, sense);
+
+  // add the sum of the blocks before
+  // O(n/p)
+  uint32_t offset = team.sum[tid].val;
+  if (offset != 0)
+    array_range_add(&prefix_sum[lo], hi - lo + 1, offset);
+  barrier_wait(&team.barrier, sense);
+}
+
+void publish(int c, uint64_t tag, uint64_t status, uint32_t val) {
+  __atomic_store_n(&chunk_status[c], tag | status << 32 | val,
+                   __ATOMIC_RELEASE);
+}
 
-    // add prefix sum of subinterval sum to get prefix sum of original array
-    // O(n/p)
-    int num_thread_2 = num_thread - 1;
-    for (int i = 0; i < num_thread_2; i++) {
-      // get all val before launching threads to prevent race condition
-      int start_idx = 1 + block_size * (i + 1);
-      arguments[i].arr = &prefix_sum[start_idx];
-      arguments[i].start_idx = start_idx;
-      arguments[i].len = block_size - (i == num_thread_2 - 1) * remain_size;
-      arguments[i].val = prefix_sum_sub[i];
+// sum of the chunks before chunk c, from their status words
+uint32_t look_back(int c, uint64_t tag) {
+  uint32_t offset = 0;
+  for (int j = c - 1, spin = 0;;) {
+    uint64_t s = __atomic_load_n(&chunk_status[j], __ATOMIC_ACQUIRE);
+    uint64_t status = s >> 32 & 3;
+    if (s >> 34 != tag >> 34 || status == 0) {
+      // chunk j is claimed but not yet scanned; its thread may be preempted
+      if (++spin % SPIN_ITERS == 0)
+        sched_yield();
+      cpu_relax();
+      continue;
     }
-    for (int i = 0; i < num_thread_2; i++) {
-      pthread_create(&pool[i], NULL, array_range_add, &arguments[i]);
+    offset += (uint32_t)s;
+    if (status == STATUS_PREFIX)
+      return offset;
+    j--;
+  }
+}
+
+// single-pass prefix sum of prefix_sum[1..n]
+void scan_lookback(int tid, int *sense) {
+  int n = team.n;
+  uint32_t key = team.key;
+  uint64_t tag = (team.query & ((1UL << 30) - 1)) << 34;
+  uint32_t buf[CHUNK];
+  for (;;) {
+    int c = __atomic_fetch_add(&team.next_chunk, 1, __ATOMIC_RELAXED);
+    int lo = 1 + CHUNK * c;
+    if (lo > n)
+      break;
+    int len = min(CHUNK, n - lo + 1);
+    uint32_t sum = calc_prefix_sub(buf, lo, len, key), offset = 0;
+    if (c > 0) {
+      publish(c, tag, STATUS_AGGREGATE, sum);
+      offset = look_back(c, tag);
     }
-    for (int i = 0; i < num_thread_2; i++) {
-      pthread_join(pool[i], NULL);
+    publish(c, tag, STATUS_PREFIX, offset + sum);
+    log("scan_lookback tid=%d chunk=%d offset=%u", tid, c, offset);
+    for (int i = 0; i < len; i++)
+      prefix_sum[lo + i] = buf[i] + offset;
+  }
+  (void)tid;
+  barrier_wait(&team.barrier, sense);
+}
+
+// Hash of prefix_sum[1..n], as output() computes it, without storing the
+// array: each thread hashes the prefix sums of its block from 0, then thread
+// 0 adds every block's offset through the linearity of the hash (see
+// encrypt_scan.h) and chains the blocks. The scan and the hash stay in
+// registers, so the query touches no memory in proportion to n.
+void scan_stream(int tid, int *sense) {
+  int n = team.n, nthread = team.nthread;
+  int block_size = ceildivi(n, nthread);
+  int lo = 1 + block_size * tid, len = min(block_size, n - lo + 1);
+  if (len < 0)
+    len = 0;
+  team.sum[tid].hash = encrypt_scan_hash((uint32_t)lo, len, team.key,
+                                         &team.sum[tid].val);
+  barrier_wait(&team.barrier, sense);
+
+  if (tid == 0) {
+    uint32_t hash = 0, offset = 0;
+    for (int t = 0; t < nthread; t++) {
+      int l = 1 + block_size * t, m = min(block_size, n - l + 1);
+      if (m <= 0)
+        break;
+      hash = hash * skey_pow(m) + team.sum[t].hash + offset * skey_ones(m);
+      offset += team.sum[t].val;
     }
+    team.hash = hash;
+    log("scan_stream hash=%u", hash);
+  }
+}
+
+void *worker(void *arg) {
+  int tid = (int)(long)arg, sense = 0;
+  if (team.cpu[tid] >= 0)
+    topo_pin(team.cpu[tid]);
+  for (;;) {
+    barrier_wait(&team.barrier, &sense); // query posted
+    if (team.quit)
+      break;
+    if (team.mode == SCAN_LOOKBACK)
+      scan_lookback(tid, &sense);
+    else if (team.mode == SCAN_STREAM)
+      scan_stream(tid, &sense);
+    else
+      scan(tid, &sense);
+  }
+  return NULL;
+}
+
+int main() {
+  // one thread per CPU of the placement policy (see topo.h), by default one
+  // per core so that no two threads share a core's caches and ports
+  struct topo_cpu *cpus;
+  int pin;
+  team.nthread = topo_affinity(&cpus, &pin);
+  if (team.nthread < 1)
+    team.nthread = 1;
+  team.cpu = malloc(sizeof(int) * (size_t)team.nthread);
+  for (int t = 0; t < team.nthread; t++)
+    team.cpu[t] = pin && cpus != NULL ? cpus[t].cpu : -1;
+  free(cpus);
+  if (team.cpu[0] >= 0)
+    topo_pin(team.cpu[0]);
 
+  int n;
+  uint32_t key;
+
+  log("nthread=%d", team.nthread);
+
+  team.barrier = (struct barrier){.nthread = team.nthread,
+                                  .count = team.nthread,
+                                  .lock = PTHREAD_MUTEX_INITIALIZER,
+                                  .wake = PTHREAD_COND_INITIALIZER};
+  team.sum = aligned_alloc(64, sizeof(struct block_sum) * (size_t)team.nthread);
+  team.threads = malloc(sizeof(pthread_t) * (size_t)team.nthread);
+  for (int i = 1; i < team.nthread; i++)
+    pthread_create(&team.threads[i], NULL, worker, (void *)(long)i);
+
+  // PREFIXSUM_SCAN=lookback, twopass or stream picks the scan; by default
+  // a team of one thread takes the three phases, which are then a single
+  // plain scan, and a larger team the single pass
+  const char *env = getenv("PREFIXSUM_SCAN");
+  if (env == NULL)
+    team.mode = team.nthread > 1 ? SCAN_LOOKBACK : SCAN_TWOPASS;
+  else if (strcmp(env, "lookback") == 0)
+    team.mode = SCAN_LOOKBACK;
+  else if (strcmp(env, "stream") == 0)
+    team.mode = SCAN_STREAM;
+  else
+    team.mode = SCAN_TWOPASS;
+
+  int sense = 0;
+  while (scanf("%d %" PRIu32, &n, &key) == 2) {
+    team.n = n;
+    team.key = key;
+    team.query++;
+    team.next_chunk = 0;
+    barrier_wait(&team.barrier, &sense);
+    if (team.mode == SCAN_LOOKBACK)
+      scan_lookback(0, &sense);
+    else if (team.mode == SCAN_STREAM) {
+      scan_stream(0, &sense);
+      // what output() prints
+      printf("%" PRIu32 "\n", team.hash);
+      continue;
+    } else
+      scan(0, &sense);
     output(prefix_sum, n);
   }
+
+  team.quit = 1;
+  barrier_wait(&team.barrier, &sense);
+  for (int i = 1; i < team.nthread; i++)
+    pthread_join(team.threads[i], NULL);
   return 0;
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include "encrypt_scan.h"
 #include "utils.h"
 
 #define MAXN 10000005
@@ -11,11 +12,7 @@ int main() {
     int n;
     uint32_t key;
     while (scanf("%d %" PRIu32, &n, &key) == 2) {
-        uint32_t sum = 0;
-        for (int i = 1; i <= n; i++) {
-            sum += encrypt(i, key);
-            prefix_sum[i] = sum;
-        }
+        encrypt_scan(prefix_sum + 1, 1, n, key);
         output(prefix_sum, n);
     }
     return 0;
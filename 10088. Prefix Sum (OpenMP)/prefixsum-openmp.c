@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
+
+#include "encrypt_scan.h"
 #include "utils.h"
 
 #include <inttypes.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -27,43 +32,177 @@
     (_x + _y - 1) / _y;                                                        \
   })
 
+#define mini(x, y)                                                             \
+  ({                                                                           \
+    __auto_type _x = (x);                                                      \
+    __auto_type _y = (y);                                                      \
+    _x < _y ? _x : _y;                                                         \
+  })
+
 uint32_t prefix_sum[MAXN];
 
+// Single-pass scan (environment variable PREFIXSUM_SCAN=lookback, the
+// default; PREFIXSUM_SCAN=twopass selects the loops in main() and
+// PREFIXSUM_SCAN=stream scan_stream()), after the
+// decoupled look-back of Merrill and Garland. CHUNK-element chunks are
+// claimed in order from a shared counter, scanned into a private buffer and
+// written to prefix_sum once their offset is known from the status words of
+// the chunks before them.
+//
+// A status word holds the query number in the top 30 bits, one of STATUS_* in
+// the next two and the value in the low 32, so words of an earlier query are
+// never mistaken for the current one and need no reset.
+#define CHUNK 4096
+#define SPIN_ITERS 4000 // polls of a status word before yielding the CPU
+#define NUM_CHUNK ((MAXN + CHUNK - 1) / CHUNK)
+#define STATUS_AGGREGATE 1UL // value is the sum of the chunk
+#define STATUS_PREFIX 2UL    // value is the sum up to the end of the chunk
+
+uint64_t chunk_status[NUM_CHUNK];
+int next_chunk;
+
+void publish(int c, uint64_t tag, uint64_t status, uint32_t val) {
+  __atomic_store_n(&chunk_status[c], tag | status << 32 | val,
+                   __ATOMIC_RELEASE);
+}
+
+// sum of the chunks before chunk c
+uint32_t look_back(int c, uint64_t tag) {
+  uint32_t offset = 0;
+  for (int j = c - 1, spin = 0;;) {
+    uint64_t s = __atomic_load_n(&chunk_status[j], __ATOMIC_ACQUIRE);
+    uint64_t status = s >> 32 & 3;
+    if (s >> 34 != tag >> 34 || status == 0) {
+      // chunk j is claimed but not yet scanned; its thread may be preempted
+      if (++spin % SPIN_ITERS == 0)
+        sched_yield();
+      continue;
+    }
+    offset += (uint32_t)s;
+    if (status == STATUS_PREFIX)
+      return offset;
+    j--;
+  }
+}
+
+void scan_lookback(int n, uint32_t key, uint64_t query) {
+  uint64_t tag = (query & ((1UL << 30) - 1)) << 34;
+  next_chunk = 0;
+#pragma omp parallel
+  {
+    uint32_t buf[CHUNK];
+    for (;;) {
+      int c = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+      int lo = 1 + CHUNK * c;
+      if (lo > n)
+        break;
+      int len = mini(CHUNK, n - lo + 1);
+      uint32_t sum = encrypt_scan(buf, (uint32_t)lo, len, key), offset = 0;
+      if (c > 0) {
+        publish(c, tag, STATUS_AGGREGATE, sum);
+        offset = look_back(c, tag);
+      }
+      publish(c, tag, STATUS_PREFIX, offset + sum);
+      log("chunk=%d offset=%u", c, offset);
+      for (int i = 0; i < len; i++)
+        prefix_sum[lo + i] = buf[i] + offset;
+    }
+  }
+}
+
 // prefix sum of subinterval sum
 // the 2nd dimension is to solve cache false sharing
 // (cache line is 64-byte in x86)
 uint32_t prefix_sum_sub[MAX_THREAD];
 uint32_t prefix_sum_sub_tmp[MAX_THREAD][16];
 
+// the block prefix_sum[lo, lo + len) of 1..n for the calling thread of a
+// parallel region; the blocks are the same in every region of a query
+void block_of(int n, int *thread_id, int *lo, int *len) {
+#ifdef _OPENMP
+  int nthread = omp_get_num_threads();
+  *thread_id = omp_get_thread_num();
+#else
+  int nthread = 1;
+  *thread_id = 0;
+#endif
+  int block = ceildivi(n, nthread);
+  *lo = 1 + block * *thread_id;
+  *len = mini(block, n - *lo + 1);
+  if (*len < 0)
+    *len = 0;
+}
+
+// Hash of prefix_sum[1..n], as output() computes it, without storing the
+// array (PREFIXSUM_SCAN=stream): each thread hashes the prefix sums of its
+// block from 0, and the blocks are then chained with their offsets added
+// through the linearity of the hash (see encrypt_scan.h).
+struct block_hash {
+  uint32_t sum, hash;
+  int len;
+} __attribute__((aligned(64)));
+
+struct block_hash block_hash[MAX_THREAD];
+
+uint32_t scan_stream(int n, uint32_t key) {
+  memset(block_hash, 0, sizeof(block_hash));
+#pragma omp parallel
+  {
+    int thread_id, lo, len;
+    block_of(n, &thread_id, &lo, &len);
+    struct block_hash *b = &block_hash[thread_id];
+    b->hash = encrypt_scan_hash((uint32_t)lo, len, key, &b->sum);
+    b->len = len;
+  }
+
+  uint32_t hash = 0, offset = 0;
+  for (int t = 0; t < MAX_THREAD; t++) {
+    struct block_hash *b = &block_hash[t];
+    hash = hash * skey_pow(b->len) + b->hash + offset * skey_ones(b->len);
+    offset += b->sum;
+  }
+  log("hash=%u", hash);
+  return hash;
+}
+
 int main() {
 #ifdef _OPENMP
   omp_set_num_threads(MAX_THREAD);
 #endif
 
+  const char *env = getenv("PREFIXSUM_SCAN");
+  int lookback = env == NULL || strcmp(env, "lookback") == 0;
+  int stream = env != NULL && strcmp(env, "stream") == 0;
+
   int n;
   uint32_t key;
+  uint64_t query = 0;
 
   while (scanf("%d %" PRIu32, &n, &key) == 2) {
-    uint32_t sum = 0;
-#pragma omp parallel for schedule(static) firstprivate(sum)
-    // correctness rely on a static (round-robin) scheduling policy
-    for (int i = 1; i <= n; i++) {
-      sum += encrypt(i, key);
-      prefix_sum[i] = sum;
-
-#ifdef _OPENMP
-      int thread_id = omp_get_thread_num();
-#else
-      int thread_id = 0;
-#endif
+    if (stream) {
+      // what output() prints
+      printf("%" PRIu32 "\n", scan_stream(n, key));
+      continue;
+    }
+    if (lookback) {
+      scan_lookback(n, key, ++query);
+      output(prefix_sum, n);
+      continue;
+    }
 
-      prefix_sum_sub_tmp[thread_id][0] = sum;
+    // one block of prefix_sum[1..n] per thread, as in block_of()
+#pragma omp parallel
+    {
+      int thread_id, lo, len;
+      block_of(n, &thread_id, &lo, &len);
+      prefix_sum_sub_tmp[thread_id][0] =
+          encrypt_scan(prefix_sum + lo, (uint32_t)lo, len, key);
 
-      log("thread=%d i=%d sum=%d prefix_sum_sub[%d]=%d", thread_id, i, sum,
-          thread_id, sum);
+      log("thread=%d lo=%d len=%d prefix_sum_sub[%d]=%d", thread_id, lo, len,
+          thread_id, prefix_sum_sub_tmp[thread_id][0]);
     }
 
-    sum = 0;
+    uint32_t sum = 0;
     for (int i = 0; i < MAX_THREAD; i++) {
       sum += prefix_sum_sub_tmp[i][0];
       prefix_sum_sub[i] = sum;
@@ -83,18 +222,16 @@ int main() {
     //       log("");
     //     }
 
-#pragma omp parallel for schedule(static)
-    for (int i = 1; i <= n; i++) {
-#ifdef _OPENMP
-      int thread_id = omp_get_thread_num();
-#else
-      int thread_id = 0;
-#endif
-
+#pragma omp parallel
+    {
+      int thread_id, lo, len;
+      block_of(n, &thread_id, &lo, &len);
       if (thread_id > 0)
-        prefix_sum[i] += prefix_sum_sub[thread_id - 1];
+        for (int i = lo; i < lo + len; i++)
+          prefix_sum[i] += prefix_sum_sub[thread_id - 1];
 
-      log("thread=%d i=%d prefix_sum[%d]=%d", thread_id, i, i, prefix_sum[i]);
+      log("thread=%d lo=%d len=%d offset=%d", thread_id, lo, len,
+          thread_id > 0 ? prefix_sum_sub[thread_id - 1] : 0);
     }
 
     output(prefix_sum, n);
@@ -1,3 +1,4 @@
+#include "encrypt_scan.h"
 #include "utils.h"
 
 #include <inttypes.h>
@@ -14,11 +15,7 @@ int main() {
   int n;
   uint32_t key;
   while (scanf("%d %" PRIu32, &n, &key) == 2) {
-    uint32_t sum = 0;
-    for (int i = 1; i <= n; i++) {
-      sum += encrypt(i, key);
-      prefix_sum[i] = sum;
-    }
+    encrypt_scan(prefix_sum + 1, 1, n, key);
     output(prefix_sum, n);
   }
   return 0;